@@ -0,0 +1,789 @@
+// Micro benchmarks for the btree.
+//
+// Build with something like:
+//   g++ -std=c++14 -O2 -DNDEBUG -Wall -pthread -Isrc -o btree_bench
+//       bench/btree_bench.cpp
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "btree.hpp"
+#include "durable_btree.hpp"
+#include "mapped_btree.hpp"
+#include "paged_btree.hpp"
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+// Keeps the optimizer from discarding results we never look at.
+template <typename T> void do_not_optimize(const T &value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+double ns_per_op(clock_type::time_point start, clock_type::time_point stop,
+                 std::size_t ops) {
+  return std::chrono::duration<double, std::nano>(stop - start).count() / ops;
+}
+
+void report(const char *name, std::size_t n, double ns) {
+  std::cout << name << "/" << n << ": " << ns << " ns/op" << std::endl;
+}
+
+std::vector<std::int64_t> random_keys(std::size_t n, std::uint64_t seed) {
+  std::vector<std::int64_t> keys(n);
+  std::mt19937_64 rng(seed);
+  for (auto &key : keys) {
+    key = static_cast<std::int64_t>(rng());
+  }
+  return keys;
+}
+
+// A value of the given size, for measuring how much value bytes get in the
+// way of searching.
+template <std::size_t Bytes> struct blob {
+  blob() = default;
+  blob(std::int64_t v) { words[0] = v; }
+
+  std::int64_t words[Bytes / sizeof(std::int64_t)] = {};
+};
+
+template <typename V> void bench_lookup(const char *name, std::size_t n) {
+  amidvidy::btree<std::int64_t, V> bt;
+  auto keys = random_keys(n, 1);
+  for (auto key : keys) {
+    bt.insert(key, V(key));
+  }
+
+  auto probes = keys;
+  std::shuffle(probes.begin(), probes.end(), std::mt19937_64(2));
+
+  auto start = clock_type::now();
+  for (auto key : probes) {
+    auto iter = bt.search(key);
+    do_not_optimize(iter);
+  }
+  auto stop = clock_type::now();
+  report(name, n, ns_per_op(start, stop, probes.size()));
+}
+
+// The same probes looked up one at a time and with multi_search, which
+// overlaps the cache misses of a batch of descents.
+void bench_multi_search(std::size_t n, std::size_t batch) {
+  amidvidy::btree<std::int64_t, std::int64_t> bt;
+  auto keys = random_keys(n, 1);
+  for (auto key : keys) {
+    bt.insert(key, key);
+  }
+
+  auto probes = keys;
+  std::shuffle(probes.begin(), probes.end(), std::mt19937_64(2));
+  probes.resize(std::min<std::size_t>(probes.size(), 1000000));
+
+  using iterator = amidvidy::btree<std::int64_t, std::int64_t>::iterator;
+  std::vector<iterator> results(batch);
+  auto start = clock_type::now();
+  for (std::size_t i = 0; i + batch <= probes.size(); i += batch) {
+    for (std::size_t j = 0; j < batch; ++j) {
+      results[j] = bt.search(probes[i + j]);
+    }
+    do_not_optimize(results);
+  }
+  auto stop = clock_type::now();
+  report("search_loop", n, ns_per_op(start, stop, probes.size()));
+
+  start = clock_type::now();
+  for (std::size_t i = 0; i + batch <= probes.size(); i += batch) {
+    bt.multi_search(probes.begin() + i, probes.begin() + i + batch,
+                    results.begin());
+    do_not_optimize(results);
+  }
+  stop = clock_type::now();
+  report("multi_search", n, ns_per_op(start, stop, probes.size()));
+}
+
+// Ingesting sorted micro-batches into a tree that already holds `n` random
+// keys, one insert at a time and with insert_batch.
+void bench_insert_batch(std::size_t n, std::size_t batch) {
+  auto keys = random_keys(n, 1);
+  std::vector<std::tuple<std::int64_t, std::int64_t>> items;
+  for (auto key : random_keys(1000000, 3)) {
+    items.emplace_back(key, key);
+  }
+  std::sort(items.begin(), items.end());
+
+  // Each batch is a run of consecutive new keys, which fall between the
+  // existing ones in a slice of the key space, as rows from a feed ordered
+  // by key do. How many share a leaf depends on `batch` and `n`.
+  std::vector<std::vector<std::tuple<std::int64_t, std::int64_t>>> batches;
+  for (std::size_t b = 0; b < 100 && (b + 1) * batch <= items.size(); ++b) {
+    batches.emplace_back(items.begin() + b * batch,
+                         items.begin() + (b + 1) * batch);
+  }
+  std::size_t rows = 0;
+  for (auto &rows_in : batches) {
+    rows += rows_in.size();
+  }
+
+  amidvidy::btree<std::int64_t, std::int64_t> one_by_one;
+  amidvidy::btree<std::int64_t, std::int64_t> batched;
+  for (auto key : keys) {
+    one_by_one.insert(key, key);
+    batched.insert(key, key);
+  }
+
+  auto start = clock_type::now();
+  for (auto &rows_in : batches) {
+    for (auto &row : rows_in) {
+      one_by_one.insert(std::get<0>(row), std::get<1>(row));
+    }
+  }
+  auto stop = clock_type::now();
+  std::cout << "batch " << batch << " ";
+  report("insert_loop", n, ns_per_op(start, stop, rows));
+
+  start = clock_type::now();
+  for (auto &rows_in : batches) {
+    batched.insert_batch(rows_in.begin(), rows_in.end());
+  }
+  stop = clock_type::now();
+  std::cout << "batch " << batch << " ";
+  report("insert_batch", n, ns_per_op(start, stop, rows));
+}
+
+// Steady-state churn: every op erases a live key and inserts a new one.
+void bench_churn(std::size_t n, float min_fill) {
+  amidvidy::btree<std::int64_t, std::int64_t> bt;
+  bt.set_min_fill(min_fill);
+  auto keys = random_keys(n, 3);
+  for (auto key : keys) {
+    bt.insert(key, key);
+  }
+
+  auto fresh = random_keys(n, 4);
+  std::mt19937_64 rng(5);
+  auto start = clock_type::now();
+  for (std::size_t i = 0; i < n; ++i) {
+    auto &victim = keys[rng() % n];
+    bt.erase(victim);
+    victim = fresh[i];
+    bt.insert(victim, victim);
+  }
+  auto stop = clock_type::now();
+  std::cout << "churn/min_fill:" << min_fill << "/" << n << ": "
+            << ns_per_op(start, stop, n) << " ns/op" << std::endl;
+}
+
+// Erases everything in random order.
+void bench_drain(std::size_t n, float min_fill) {
+  amidvidy::btree<std::int64_t, std::int64_t> bt;
+  bt.set_min_fill(min_fill);
+  auto keys = random_keys(n, 6);
+  for (auto key : keys) {
+    bt.insert(key, key);
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937_64(7));
+
+  auto start = clock_type::now();
+  for (auto key : keys) {
+    bt.erase(key);
+  }
+  auto stop = clock_type::now();
+  std::cout << "drain/min_fill:" << min_fill << "/" << n << ": "
+            << ns_per_op(start, stop, n) << " ns/op" << std::endl;
+}
+
+// Building from sorted input: one insert at a time versus bulk_load.
+void bench_build_sorted(std::size_t n) {
+  std::vector<std::tuple<std::int64_t, std::int64_t>> items(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    items[i] = std::make_tuple(i, i);
+  }
+
+  {
+    auto start = clock_type::now();
+    amidvidy::btree<std::int64_t, std::int64_t> bt;
+    for (auto &item : items) {
+      bt.insert(std::get<0>(item), std::get<1>(item));
+    }
+    auto stop = clock_type::now();
+    report("build_sorted/insert", n, ns_per_op(start, stop, n));
+  }
+  {
+    auto start = clock_type::now();
+    amidvidy::btree<std::int64_t, std::int64_t> bt(items.begin(),
+                                                   items.end());
+    auto stop = clock_type::now();
+    report("build_sorted/bulk_load", n, ns_per_op(start, stop, n));
+  }
+}
+
+struct huge_page_policy : amidvidy::btree_policy {
+  static constexpr bool huge_pages = true;
+};
+
+// Random inserts followed by a full in-order walk, which is where node
+// placement shows: the leaf chain is followed in key order, not in the order
+// the leaves were allocated.
+template <typename Policy> void bench_insert_walk(const char *name,
+                                                  std::size_t n) {
+  amidvidy::btree<std::int64_t, std::int64_t, 100, std::less<std::int64_t>,
+                  Policy>
+      bt;
+  auto keys = random_keys(n, 11);
+  auto start = clock_type::now();
+  for (auto key : keys) {
+    bt.insert(key, key);
+  }
+  auto stop = clock_type::now();
+  std::cout << "insert_random/" << name << "/" << n << ": "
+            << ns_per_op(start, stop, n) << " ns/op" << std::endl;
+
+  std::int64_t sum = 0;
+  start = clock_type::now();
+  for (auto it = bt.begin(); it != bt.end(); ++it) {
+    sum += std::get<1>(*it);
+  }
+  stop = clock_type::now();
+  do_not_optimize(sum);
+  std::cout << "walk/" << name << "/" << n << ": "
+            << ns_per_op(start, stop, n) << " ns/op" << std::endl;
+}
+
+// Stands in for std::string_view, which C++14 does not have yet.
+struct key_view {
+  const char *data;
+  std::size_t size;
+};
+
+struct string_less {
+  using is_transparent = void;
+
+  bool operator()(const std::string &a, const std::string &b) const {
+    return a < b;
+  }
+  bool operator()(const std::string &a, key_view b) const {
+    return a.compare(0, a.size(), b.data, b.size) < 0;
+  }
+  bool operator()(key_view a, const std::string &b) const {
+    return b.compare(0, b.size(), a.data, a.size) > 0;
+  }
+};
+
+// String keys too long for the small string buffer, looked up from a view of
+// someone else's bytes: building a std::string per lookup versus handing the
+// view to a transparent comparator.
+void bench_string_lookup(std::size_t n) {
+  std::vector<std::string> keys;
+  for (auto key : random_keys(n, 12)) {
+    keys.push_back("user:" + std::to_string(key) + ":profile");
+  }
+  amidvidy::btree<std::string, std::int64_t, 100, string_less> bt;
+  for (std::size_t i = 0; i < n; ++i) {
+    bt.insert(keys[i], i);
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937_64(13));
+
+  auto start = clock_type::now();
+  for (auto &key : keys) {
+    key_view probe{key.data(), key.size()};
+    do_not_optimize(bt.find(std::string(probe.data, probe.size)));
+  }
+  auto stop = clock_type::now();
+  report("string_lookup/temporary", n, ns_per_op(start, stop, n));
+
+  start = clock_type::now();
+  for (auto &key : keys) {
+    key_view probe{key.data(), key.size()};
+    do_not_optimize(bt.find(probe));
+  }
+  stop = clock_type::now();
+  report("string_lookup/transparent", n, ns_per_op(start, stop, n));
+}
+
+// Short range scans of about `width` entries: scan() with a callback versus
+// walking iterators from lower_bound.
+void bench_range_scan(std::size_t n, std::int64_t width) {
+  amidvidy::btree<std::int64_t, std::int64_t> bt;
+  for (std::size_t i = 0; i < n; ++i) {
+    bt.insert(i, i);
+  }
+  // Each side gets its own start keys so neither finds leaves the other
+  // already pulled into cache.
+  auto start_keys = [&](std::uint64_t seed) {
+    auto keys = random_keys(10000, seed);
+    for (auto &key : keys) {
+      key = static_cast<std::uint64_t>(key) % n;
+    }
+    return keys;
+  };
+  auto scan_starts = start_keys(8);
+  auto iter_starts = start_keys(9);
+
+  // Whichever side runs first would otherwise also pay for pulling the
+  // internal nodes into cache.
+  for (auto lo : start_keys(10)) {
+    do_not_optimize(bt.lower_bound(lo));
+  }
+
+  std::size_t visited = 0;
+  auto start = clock_type::now();
+  for (auto lo : scan_starts) {
+    std::int64_t sum = 0;
+    visited += bt.scan(lo, lo + width,
+                       [&](const std::int64_t &, std::int64_t &value) {
+                         sum += value;
+                       });
+    do_not_optimize(sum);
+  }
+  auto stop = clock_type::now();
+  report("range_scan/callback", n, ns_per_op(start, stop, visited));
+
+  visited = 0;
+  start = clock_type::now();
+  for (auto lo : iter_starts) {
+    std::int64_t sum = 0;
+    for (auto it = bt.lower_bound(lo);
+         it != bt.end() && std::get<0>(*it) < lo + width; ++it) {
+      sum += std::get<1>(*it);
+      ++visited;
+    }
+    do_not_optimize(sum);
+  }
+  stop = clock_type::now();
+  report("range_scan/iterator", n, ns_per_op(start, stop, visited));
+}
+
+struct checked_policy : amidvidy::btree_policy {
+  static constexpr bool checked_iterators = true;
+};
+
+struct unchecked_policy : amidvidy::btree_policy {
+  static constexpr bool checked_iterators = false;
+};
+
+// A walk over the whole tree, with and without iterator checks, and with
+// scan() for comparison.
+template <typename Policy> void bench_full_scan(const char *name,
+                                                std::size_t n) {
+  amidvidy::btree<std::int64_t, std::int64_t, 0, std::less<std::int64_t>,
+                  Policy>
+      bt;
+  for (auto key : random_keys(n, 1)) {
+    bt.insert(key, key);
+  }
+
+  double best = 0;
+  for (int pass = 0; pass < 5; ++pass) {
+    std::int64_t sum = 0;
+    auto start = clock_type::now();
+    for (auto it = bt.begin(), end = bt.end(); it != end; ++it) {
+      sum += std::get<1>(*it);
+    }
+    auto stop = clock_type::now();
+    do_not_optimize(sum);
+    auto ns = ns_per_op(start, stop, n);
+    best = pass ? std::min(best, ns) : ns;
+  }
+  report(name, n, best);
+}
+
+void bench_full_scan_callback(std::size_t n) {
+  amidvidy::btree<std::int64_t, std::int64_t> bt;
+  for (auto key : random_keys(n, 1)) {
+    bt.insert(key, key);
+  }
+
+  double best = 0;
+  for (int pass = 0; pass < 5; ++pass) {
+    std::int64_t sum = 0;
+    auto start = clock_type::now();
+    bt.scan(std::numeric_limits<std::int64_t>::min(),
+            std::numeric_limits<std::int64_t>::max(),
+            [&](const std::int64_t &, std::int64_t &value) { sum += value; });
+    auto stop = clock_type::now();
+    do_not_optimize(sum);
+    auto ns = ns_per_op(start, stop, n);
+    best = pass ? std::min(best, ns) : ns;
+  }
+  report("full_scan/callback", n, best);
+}
+
+struct order_statistics_policy : amidvidy::btree_policy {
+  static constexpr bool order_statistics = true;
+};
+
+// Random inserts with and without subtree counts, then position lookups
+// with select() and range counts with count() versus walking the range.
+void bench_order_statistics(std::size_t n, std::size_t width) {
+  auto keys = random_keys(n, 11);
+  amidvidy::btree<std::int64_t, std::int64_t> plain;
+  auto start = clock_type::now();
+  for (auto key : keys) {
+    plain.insert(key, key);
+  }
+  auto stop = clock_type::now();
+  report("order_statistics/insert_plain", n, ns_per_op(start, stop, n));
+
+  amidvidy::btree<std::int64_t, std::int64_t, 0, std::less<std::int64_t>,
+                  order_statistics_policy>
+      bt;
+  start = clock_type::now();
+  for (auto key : keys) {
+    bt.insert(key, key);
+  }
+  stop = clock_type::now();
+  report("order_statistics/insert_counted", n, ns_per_op(start, stop, n));
+
+  constexpr std::size_t probes = 100000;
+  auto positions = random_keys(probes, 12);
+  start = clock_type::now();
+  for (auto position : positions) {
+    do_not_optimize(bt.select(static_cast<std::uint64_t>(position) % n));
+  }
+  stop = clock_type::now();
+  report("order_statistics/select", n, ns_per_op(start, stop, probes));
+
+  // Ranges of about `width` entries, starting at a random entry.
+  std::vector<std::pair<std::int64_t, std::int64_t>> ranges;
+  for (auto position : random_keys(1000, 13)) {
+    auto first = static_cast<std::uint64_t>(position) % (n - width);
+    ranges.emplace_back(std::get<0>(*bt.select(first)),
+                        std::get<0>(*bt.select(first + width)));
+  }
+  std::size_t total = 0;
+  start = clock_type::now();
+  for (auto &range : ranges) {
+    total += bt.count(range.first, range.second);
+  }
+  stop = clock_type::now();
+  do_not_optimize(total);
+  report("order_statistics/count", n, ns_per_op(start, stop, ranges.size()));
+
+  total = 0;
+  start = clock_type::now();
+  for (auto &range : ranges) {
+    total += plain.scan(range.first, range.second,
+                        [](const std::int64_t &, std::int64_t &) {});
+  }
+  stop = clock_type::now();
+  do_not_optimize(total);
+  report("order_statistics/count_by_scan", n,
+         ns_per_op(start, stop, ranges.size()));
+}
+
+struct sum_of_values {
+  using result_type = std::int64_t;
+  static result_type identity() { return 0; }
+  static result_type of(const std::int64_t &, const std::int64_t &value) {
+    return value;
+  }
+  static result_type combine(const result_type &a, const result_type &b) {
+    return a + b;
+  }
+};
+
+struct sum_policy : amidvidy::btree_policy {
+  using aggregate = sum_of_values;
+};
+
+// Random inserts into a tree keeping sums, then sums over ranges with
+// aggregate() versus adding up the values with scan().
+void bench_aggregate(std::size_t n, std::size_t width) {
+  auto keys = random_keys(n, 14);
+  amidvidy::btree<std::int64_t, std::int64_t, 0, std::less<std::int64_t>,
+                  sum_policy>
+      bt;
+  auto start = clock_type::now();
+  for (auto key : keys) {
+    bt.insert(key, key & 0xffff);
+  }
+  auto stop = clock_type::now();
+  report("aggregate/insert_summed", n, ns_per_op(start, stop, n));
+
+  // Ranges of about `width` entries.
+  std::sort(keys.begin(), keys.end());
+  std::vector<std::pair<std::int64_t, std::int64_t>> ranges;
+  for (auto position : random_keys(1000, 15)) {
+    auto first = static_cast<std::uint64_t>(position) % (n - width);
+    ranges.emplace_back(keys[first], keys[first + width]);
+  }
+  std::int64_t total = 0;
+  start = clock_type::now();
+  for (auto &range : ranges) {
+    total += bt.aggregate(range.first, range.second);
+  }
+  stop = clock_type::now();
+  do_not_optimize(total);
+  report("aggregate/sum", n, ns_per_op(start, stop, ranges.size()));
+
+  std::int64_t scanned = 0;
+  start = clock_type::now();
+  for (auto &range : ranges) {
+    bt.scan(range.first, range.second,
+            [&](const std::int64_t &, std::int64_t &value) {
+              scanned += value;
+            });
+  }
+  stop = clock_type::now();
+  do_not_optimize(scanned);
+  report("aggregate/sum_by_scan", n, ns_per_op(start, stop, ranges.size()));
+}
+
+// A paged tree in a scratch file: random inserts, then random lookups with
+// a cache that holds all of the tree and with one that holds a small part.
+void bench_paged(std::size_t n) {
+  const char *path = "btree_bench.pages";
+  std::remove(path);
+  auto keys = random_keys(n, 16);
+  std::size_t file_bytes = 0;
+  {
+    amidvidy::paged_btree<std::int64_t, std::int64_t> bt(path, 1 << 30);
+    auto start = clock_type::now();
+    for (auto key : keys) {
+      bt.insert(key, key);
+    }
+    bt.flush();
+    auto stop = clock_type::now();
+    report("paged/insert", n, ns_per_op(start, stop, n));
+    file_bytes = bt.pages() * bt.page_bytes;
+  }
+
+  auto probes = random_keys(100000, 17);
+  for (auto &probe : probes) {
+    probe = keys[static_cast<std::uint64_t>(probe) % n];
+  }
+  for (auto share : {1, 16}) {
+    amidvidy::paged_btree<std::int64_t, std::int64_t> bt(path,
+                                                         file_bytes / share);
+    // Warm the cache up.
+    std::int64_t value;
+    for (auto key : probes) {
+      do_not_optimize(bt.lookup(key, value));
+    }
+    auto start = clock_type::now();
+    for (auto key : probes) {
+      do_not_optimize(bt.lookup(key, value));
+    }
+    auto stop = clock_type::now();
+    report(share == 1 ? "paged/lookup_all_cached"
+                      : "paged/lookup_1_16th_cached",
+           n, ns_per_op(start, stop, probes.size()));
+  }
+  std::remove(path);
+}
+
+// Restarting from a saved tree: the save, then getting back to a searchable
+// tree by mapping the file versus inserting everything again, then random
+// lookups in the mapping.
+void bench_mapped(std::size_t n) {
+  const char *path = "btree_bench.image";
+  auto keys = random_keys(n, 18);
+  amidvidy::btree<std::int64_t, std::int64_t> bt;
+  for (auto key : keys) {
+    bt.insert(key, key);
+  }
+
+  auto start = clock_type::now();
+  bt.save(path);
+  auto stop = clock_type::now();
+  report("mapped/save", n, ns_per_op(start, stop, n));
+
+  start = clock_type::now();
+  {
+    amidvidy::btree<std::int64_t, std::int64_t> rebuilt;
+    for (auto key : keys) {
+      rebuilt.insert(key, key);
+    }
+    do_not_optimize(rebuilt.empty());
+    stop = clock_type::now();
+  }
+  report("mapped/restart_by_inserting", n, ns_per_op(start, stop, 1));
+
+  start = clock_type::now();
+  amidvidy::mapped_btree<std::int64_t, std::int64_t> mapped(path);
+  stop = clock_type::now();
+  report("mapped/restart_by_mapping", n, ns_per_op(start, stop, 1));
+
+  auto probes = random_keys(1000000, 19);
+  for (auto &probe : probes) {
+    probe = keys[static_cast<std::uint64_t>(probe) % n];
+  }
+  std::int64_t value;
+  start = clock_type::now();
+  for (auto key : probes) {
+    do_not_optimize(mapped.lookup(key, value));
+  }
+  stop = clock_type::now();
+  report("mapped/lookup", n, ns_per_op(start, stop, probes.size()));
+
+  start = clock_type::now();
+  for (auto key : probes) {
+    do_not_optimize(bt.lookup(key, value));
+  }
+  stop = clock_type::now();
+  report("mapped/lookup_in_memory", n, ns_per_op(start, stop, probes.size()));
+  std::remove(path);
+}
+
+// Random inserts into a durable tree, syncing the log once per insert and
+// once per group of 16 and 256, next to the paged tree without a log.
+void bench_durable(std::size_t n) {
+  const std::string path = "btree_bench.durable";
+  auto remove_files = [&] {
+    std::remove(path.c_str());
+    std::remove((path + ".wal").c_str());
+    std::remove((path + ".journal").c_str());
+  };
+  auto keys = random_keys(n, 20);
+  for (std::size_t group : {1, 16, 256}) {
+    remove_files();
+    amidvidy::durability_options options;
+    options.group_commit = group;
+    // Per-insert syncs are slow enough that a fraction of the keys will do.
+    auto count = group == 1 ? n / 100 : n;
+    amidvidy::durable_btree<std::int64_t, std::int64_t> bt(path, 64 << 20,
+                                                           options);
+    auto start = clock_type::now();
+    for (std::size_t i = 0; i < count; ++i) {
+      bt.insert(keys[i], keys[i]);
+    }
+    bt.commit();
+    auto stop = clock_type::now();
+    auto name = "durable/insert_group_" + std::to_string(group);
+    report(name.c_str(), count, ns_per_op(start, stop, count));
+  }
+  remove_files();
+  {
+    amidvidy::paged_btree<std::int64_t, std::int64_t> bt(path, 64 << 20);
+    auto start = clock_type::now();
+    for (auto key : keys) {
+      bt.insert(key, key);
+    }
+    bt.flush();
+    auto stop = clock_type::now();
+    report("durable/insert_without_log", n, ns_per_op(start, stop, n));
+  }
+  remove_files();
+}
+
+struct concurrent_policy : amidvidy::btree_policy {
+  static constexpr bool concurrent = true;
+};
+
+// Runs `threads` threads against one tree, each doing `ops` operations of
+// which one in `write_every` is an insert, and reports aggregate ns/op.
+template <typename Tree, typename Lookup, typename Insert>
+void run_threads(const char *name, Tree &bt, std::size_t threads,
+                 std::size_t ops, std::size_t write_every, Lookup lookup,
+                 Insert insert) {
+  auto keys = random_keys(1000000, 8);
+  for (auto key : keys) {
+    bt.insert(key, key);
+  }
+
+  std::vector<std::thread> workers;
+  auto start = clock_type::now();
+  for (std::size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      std::mt19937_64 rng(t);
+      std::int64_t value = 0;
+      for (std::size_t i = 0; i < ops; ++i) {
+        if (i % write_every == 0) {
+          auto key = static_cast<std::int64_t>(rng());
+          insert(bt, key, key);
+        } else {
+          lookup(bt, keys[rng() % keys.size()], value);
+        }
+      }
+      do_not_optimize(value);
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  auto stop = clock_type::now();
+  std::cout << name << "/threads:" << threads << ": "
+            << ns_per_op(start, stop, threads * ops) << " ns/op" << std::endl;
+}
+
+// Optimistic lock coupling against the same tree behind one mutex, with one
+// write per ten operations.
+void bench_concurrent(std::size_t threads) {
+  const std::size_t ops = 200000;
+  {
+    amidvidy::btree<std::int64_t, std::int64_t, 100u,
+                    std::less<std::int64_t>, concurrent_policy>
+        bt;
+    run_threads("concurrent/olc", bt, threads, ops, 10,
+                [](auto &bt, std::int64_t key, std::int64_t &value) {
+                  bt.lookup(key, value);
+                },
+                [](auto &bt, std::int64_t key, std::int64_t value) {
+                  bt.insert(key, value);
+                });
+  }
+  {
+    amidvidy::btree<std::int64_t, std::int64_t> bt;
+    std::mutex mutex;
+    run_threads("concurrent/mutex", bt, threads, ops, 10,
+                [&](auto &bt, std::int64_t key, std::int64_t &value) {
+                  std::lock_guard<std::mutex> lock(mutex);
+                  bt.lookup(key, value);
+                },
+                [&](auto &bt, std::int64_t key, std::int64_t value) {
+                  std::lock_guard<std::mutex> lock(mutex);
+                  bt.insert(key, value);
+                });
+  }
+}
+
+} // namespace
+
+int main() {
+  for (std::size_t n : {1000u, 100000u, 1000000u}) {
+    bench_lookup<std::int64_t>("lookup", n);
+  }
+  for (std::size_t n : {1000u, 100000u, 1000000u}) {
+    bench_lookup<blob<64>>("lookup_value64", n);
+  }
+  for (std::size_t n : {1000u, 100000u}) {
+    bench_lookup<blob<256>>("lookup_value256", n);
+  }
+  for (std::size_t n : {100000u, 1000000u, 10000000u}) {
+    bench_multi_search(n, 256);
+  }
+  for (std::size_t batch : {1000u, 10000u}) {
+    bench_insert_batch(1000000, batch);
+  }
+  bench_build_sorted(10000000);
+  bench_range_scan(1000000, 100);
+  bench_full_scan<checked_policy>("full_scan/checked", 10000000);
+  bench_full_scan<unchecked_policy>("full_scan/unchecked", 10000000);
+  bench_full_scan_callback(10000000);
+  bench_order_statistics(10000000, 100000);
+  bench_aggregate(10000000, 100000);
+  bench_paged(4000000);
+  bench_mapped(10000000);
+  bench_durable(1000000);
+  bench_string_lookup(100000);
+  bench_insert_walk<amidvidy::btree_policy>("default", 4000000);
+  bench_insert_walk<huge_page_policy>("huge_pages", 4000000);
+  for (float min_fill : {0.0f, 0.25f, 0.5f}) {
+    bench_churn(1000000, min_fill);
+    bench_drain(1000000, min_fill);
+  }
+  for (std::size_t threads : {1u, 4u, 16u}) {
+    bench_concurrent(threads);
+  }
+}
@@ -0,0 +1,561 @@
+// Benchmark suite comparing the btree against std::map, std::multimap and a
+// sorted vector, built on Google Benchmark.
+//
+// Build with something like:
+//   g++ -std=c++14 -O2 -DNDEBUG -pthread -Isrc -o btree_suite
+//       bench/btree_suite.cpp -lbenchmark
+//
+// and pick workloads with --benchmark_filter, e.g.
+//   ./btree_suite --benchmark_filter='lookup_hit<btree_128'
+//
+// Every workload is a template over a container adapter and a key
+// distribution, and takes the number of entries as its first argument.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include <benchmark/benchmark.h>
+
+#include "btree.hpp"
+
+namespace {
+
+// Keys and values are made from 64-bit ids, so every workload can be run
+// with any key and value type.
+
+template <typename T> struct make;
+
+template <> struct make<std::int64_t> {
+  static std::int64_t from(std::uint64_t id) {
+    return static_cast<std::int64_t>(id);
+  }
+};
+
+// Zero padded so that string keys sort like the ids they came from.
+template <> struct make<std::string> {
+  static std::string from(std::uint64_t id) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "key:%016llx",
+                  static_cast<unsigned long long>(id));
+    return buffer;
+  }
+};
+
+// A value of the given size.
+template <std::size_t Bytes> struct payload {
+  std::uint64_t words[Bytes / sizeof(std::uint64_t)] = {};
+};
+
+template <std::size_t Bytes> struct make<payload<Bytes>> {
+  static payload<Bytes> from(std::uint64_t id) {
+    payload<Bytes> value;
+    value.words[0] = id;
+    return value;
+  }
+};
+
+// A bijection on 64-bit ids (the splitmix64 finalizer), used to spread ids
+// over the key space without ever mapping two ids to one key.
+std::uint64_t scramble(std::uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+// Zipfian ids in [0, n), with 0 the most popular, generated as in YCSB
+// (Gray et al., "Quickly generating billion-record synthetic databases").
+class zipf_generator {
+public:
+  explicit zipf_generator(std::uint64_t n, double theta = 0.99)
+      : _n(n), _theta(theta), _alpha(1 / (1 - theta)), _zetan(zeta(n)) {
+    _eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta(2) / _zetan);
+  }
+
+  template <typename Rng> std::uint64_t operator()(Rng &rng) {
+    auto u = std::uniform_real_distribution<double>()(rng);
+    auto uz = u * _zetan;
+    if (uz < 1) {
+      return 0;
+    }
+    if (uz < 1 + std::pow(0.5, _theta)) {
+      return 1;
+    }
+    auto id = static_cast<std::uint64_t>(
+        _n * std::pow(_eta * u - _eta + 1, _alpha));
+    return std::min(id, _n - 1);
+  }
+
+private:
+  double zeta(std::uint64_t n) const {
+    double sum = 0;
+    for (std::uint64_t i = 1; i <= n; ++i) {
+      sum += 1 / std::pow(static_cast<double>(i), _theta);
+    }
+    return sum;
+  }
+
+  std::uint64_t _n;
+  double _theta;
+  double _alpha;
+  double _zetan;
+  double _eta;
+};
+
+// Key distributions. Each decides the order the n entries of a container are
+// inserted in, which ids later probes ask for, and how ids become keys. Ids
+// from n up are never inserted, which is what lookup misses use.
+
+// Keys 0, 1, 2, ... inserted in order; probes walk them in order too.
+struct sequential {
+  static std::uint64_t key(std::uint64_t id) { return id; }
+
+  static std::vector<std::uint64_t> inserts(std::size_t n) {
+    std::vector<std::uint64_t> ids(n);
+    for (std::size_t i = 0; i < n; ++i) {
+      ids[i] = i;
+    }
+    return ids;
+  }
+
+  static std::vector<std::uint64_t> probes(std::size_t n, std::size_t count) {
+    std::vector<std::uint64_t> ids(count);
+    for (std::size_t i = 0; i < count; ++i) {
+      ids[i] = i % n;
+    }
+    return ids;
+  }
+};
+
+// Distinct keys spread over the key space, inserted and probed in random
+// order.
+struct uniform {
+  static std::uint64_t key(std::uint64_t id) { return scramble(id); }
+
+  static std::vector<std::uint64_t> inserts(std::size_t n) {
+    auto ids = sequential::inserts(n);
+    std::shuffle(ids.begin(), ids.end(), std::mt19937_64(1));
+    return ids;
+  }
+
+  static std::vector<std::uint64_t> probes(std::size_t n, std::size_t count) {
+    std::mt19937_64 rng(2);
+    std::vector<std::uint64_t> ids(count);
+    for (auto &id : ids) {
+      id = rng() % n;
+    }
+    return ids;
+  }
+};
+
+// Skewed: a few keys take most of the inserts (as duplicates, or as
+// overwrites for std::map) and most of the probes. Popular keys are
+// scrambled, so they are not next to each other in the tree.
+struct zipfian {
+  static std::uint64_t key(std::uint64_t id) { return scramble(id); }
+
+  static std::vector<std::uint64_t> inserts(std::size_t n) {
+    return draw(n, n, 3);
+  }
+
+  static std::vector<std::uint64_t> probes(std::size_t n, std::size_t count) {
+    return draw(n, count, 4);
+  }
+
+private:
+  static std::vector<std::uint64_t> draw(std::size_t n, std::size_t count,
+                                         std::uint64_t seed) {
+    zipf_generator zipf(n);
+    std::mt19937_64 rng(seed);
+    std::vector<std::uint64_t> ids(count);
+    for (auto &id : ids) {
+      id = zipf(rng);
+    }
+    return ids;
+  }
+};
+
+// Container adapters. All of them provide insert, contains and scan (visit
+// up to `count` entries starting at the first key not less than `lo`), plus
+// a fill from sorted items used to set up the read workloads.
+
+// Sizes nodes by bytes rather than by BucketSize.
+template <std::size_t Bytes> struct bytes_policy : amidvidy::btree_policy {
+  static constexpr std::size_t node_bytes = Bytes;
+};
+
+template <typename K, typename V, std::size_t BucketSize,
+          typename Policy = amidvidy::btree_policy>
+class btree_adapter {
+public:
+  using key_type = K;
+  using value_type = V;
+
+  void insert(const K &key, const V &value) { _tree.insert(key, value); }
+
+  bool contains(const K &key) { return _tree.find(key) != _tree.end(); }
+
+  void scan(const K &lo, std::size_t count) {
+    for (auto it = _tree.lower_bound(lo); count && it != _tree.end();
+         ++it, --count) {
+      benchmark::DoNotOptimize(std::get<1>(*it));
+    }
+  }
+
+  template <typename It> void fill(It first, It last) {
+    _tree.bulk_load(first, last);
+  }
+
+private:
+  amidvidy::btree<K, V, BucketSize, std::less<K>, Policy> _tree;
+};
+
+template <typename Map> class map_adapter {
+public:
+  using key_type = typename Map::key_type;
+  using value_type = typename Map::mapped_type;
+
+  void insert(const key_type &key, const value_type &value) {
+    _map.emplace(key, value);
+  }
+
+  bool contains(const key_type &key) { return _map.find(key) != _map.end(); }
+
+  void scan(const key_type &lo, std::size_t count) {
+    for (auto it = _map.lower_bound(lo); count && it != _map.end();
+         ++it, --count) {
+      benchmark::DoNotOptimize(it->second);
+    }
+  }
+
+  template <typename It> void fill(It first, It last) {
+    for (; first != last; ++first) {
+      _map.emplace_hint(_map.end(), std::get<0>(*first), std::get<1>(*first));
+    }
+  }
+
+private:
+  Map _map;
+};
+
+// The cache-friendliest possible baseline for reads, and the worst for
+// writes: every insert shifts everything after it.
+template <typename K, typename V> class sorted_vector_adapter {
+public:
+  using key_type = K;
+  using value_type = V;
+
+  void insert(const K &key, const V &value) {
+    auto it = std::upper_bound(_items.begin(), _items.end(), key, key_less());
+    _items.emplace(it, key, value);
+  }
+
+  bool contains(const K &key) {
+    auto it = std::lower_bound(_items.begin(), _items.end(), key, key_less());
+    return it != _items.end() && !(key < std::get<0>(*it));
+  }
+
+  void scan(const K &lo, std::size_t count) {
+    auto it = std::lower_bound(_items.begin(), _items.end(), lo, key_less());
+    for (; count && it != _items.end(); ++it, --count) {
+      benchmark::DoNotOptimize(std::get<1>(*it));
+    }
+  }
+
+  template <typename It> void fill(It first, It last) {
+    _items.assign(first, last);
+  }
+
+private:
+  struct key_less {
+    bool operator()(const std::tuple<K, V> &item, const K &key) const {
+      return std::get<0>(item) < key;
+    }
+    bool operator()(const K &key, const std::tuple<K, V> &item) const {
+      return key < std::get<0>(item);
+    }
+  };
+
+  std::vector<std::tuple<K, V>> _items;
+};
+
+// The containers under test. BENCHMARK_TEMPLATE prints these names.
+using btree_16 = btree_adapter<std::int64_t, std::int64_t, 16>;
+using btree_64 = btree_adapter<std::int64_t, std::int64_t, 64>;
+using btree_128 = btree_adapter<std::int64_t, std::int64_t, 128>;
+using btree_256 = btree_adapter<std::int64_t, std::int64_t, 256>;
+using btree_512B =
+    btree_adapter<std::int64_t, std::int64_t, 0, bytes_policy<512>>;
+using btree_4KB =
+    btree_adapter<std::int64_t, std::int64_t, 0, bytes_policy<4096>>;
+using btree_auto = btree_adapter<std::int64_t, std::int64_t, 0>;
+using btree_128_v64 = btree_adapter<std::int64_t, payload<64>, 128>;
+using btree_auto_v64 = btree_adapter<std::int64_t, payload<64>, 0>;
+using btree_64_str = btree_adapter<std::string, std::int64_t, 64>;
+using map_i64 = map_adapter<std::map<std::int64_t, std::int64_t>>;
+using multimap_i64 = map_adapter<std::multimap<std::int64_t, std::int64_t>>;
+using map_v64 = map_adapter<std::map<std::int64_t, payload<64>>>;
+using map_str = map_adapter<std::map<std::string, std::int64_t>>;
+using vector_i64 = sorted_vector_adapter<std::int64_t, std::int64_t>;
+
+template <typename Container, typename Dist>
+typename Container::key_type key_for(std::uint64_t id) {
+  return make<typename Container::key_type>::from(Dist::key(id));
+}
+
+// The n entries of a container as sorted (key, value) tuples.
+template <typename Container, typename Dist>
+std::vector<std::tuple<typename Container::key_type,
+                       typename Container::value_type>>
+sorted_items(std::size_t n) {
+  using key_type = typename Container::key_type;
+  using value_type = typename Container::value_type;
+  std::vector<std::tuple<key_type, value_type>> items;
+  items.reserve(n);
+  for (std::size_t id = 0; id < n; ++id) {
+    items.emplace_back(key_for<Container, Dist>(id),
+                       make<value_type>::from(id));
+  }
+  std::sort(items.begin(), items.end(), [](const auto &a, const auto &b) {
+    return std::get<0>(a) < std::get<0>(b);
+  });
+  return items;
+}
+
+// Probe keys are made up front so that making them is not timed.
+template <typename Container, typename Dist>
+std::vector<typename Container::key_type> probe_keys(std::size_t n,
+                                                     bool hit) {
+  constexpr std::size_t count = 1 << 16;
+  auto ids = Dist::probes(n, count);
+  std::vector<typename Container::key_type> keys;
+  keys.reserve(count);
+  for (auto id : ids) {
+    keys.push_back(key_for<Container, Dist>(hit ? id : n + id));
+  }
+  return keys;
+}
+
+// Bytes the allocator has handed out and not had back.
+std::size_t heap_in_use() {
+#if defined(__GLIBC__)
+#if __GLIBC_PREREQ(2, 33)
+  auto info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#endif
+#endif
+  return 0;
+}
+
+template <typename Container, typename Dist>
+void insert(benchmark::State &state) {
+  auto n = static_cast<std::size_t>(state.range(0));
+  using key_type = typename Container::key_type;
+  using value_type = typename Container::value_type;
+  std::vector<std::pair<key_type, value_type>> items;
+  for (auto id : Dist::inserts(n)) {
+    items.emplace_back(key_for<Container, Dist>(id),
+                       make<value_type>::from(id));
+  }
+
+  for (auto _ : state) {
+    auto container = std::make_unique<Container>();
+    for (auto &item : items) {
+      container->insert(item.first, item.second);
+    }
+    benchmark::DoNotOptimize(container.get());
+    // Tear down untimed.
+    state.PauseTiming();
+    container.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+template <typename Container, typename Dist, bool Hit>
+void lookup(benchmark::State &state) {
+  auto n = static_cast<std::size_t>(state.range(0));
+  auto items = sorted_items<Container, Dist>(n);
+  Container container;
+  container.fill(items.begin(), items.end());
+  auto keys = probe_keys<Container, Dist>(n, Hit);
+
+  std::size_t i = 0;
+  std::size_t found = 0;
+  for (auto _ : state) {
+    found += container.contains(keys[i++ & (keys.size() - 1)]);
+  }
+  benchmark::DoNotOptimize(found);
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <typename Container, typename Dist>
+void lookup_hit(benchmark::State &state) {
+  lookup<Container, Dist, true>(state);
+}
+
+template <typename Container, typename Dist>
+void lookup_miss(benchmark::State &state) {
+  lookup<Container, Dist, false>(state);
+}
+
+// Range scans of state.range(1) entries from a random start.
+template <typename Container, typename Dist>
+void range_scan(benchmark::State &state) {
+  auto n = static_cast<std::size_t>(state.range(0));
+  auto length = static_cast<std::size_t>(state.range(1));
+  auto items = sorted_items<Container, Dist>(n);
+  Container container;
+  container.fill(items.begin(), items.end());
+  auto keys = probe_keys<Container, Dist>(n, true);
+
+  std::size_t i = 0;
+  for (auto _ : state) {
+    container.scan(keys[i++ & (keys.size() - 1)], length);
+  }
+  state.SetItemsProcessed(state.iterations() * length);
+}
+
+// Lookups mixed with inserts of new keys; state.range(1) is the percentage
+// of operations that write. Inserted keys come from ids n, n + 1, ... and
+// so never repeat, however long the run, and every container does the same
+// work. Making them is timed, but it is only a few multiplies.
+template <typename Container, typename Dist>
+void mixed(benchmark::State &state) {
+  auto n = static_cast<std::size_t>(state.range(0));
+  auto write_percent = static_cast<std::uint64_t>(state.range(1));
+  using value_type = typename Container::value_type;
+  auto items = sorted_items<Container, Dist>(n);
+  Container container;
+  container.fill(items.begin(), items.end());
+  auto keys = probe_keys<Container, Dist>(n, true);
+
+  std::mt19937_64 rng(5);
+  std::vector<bool> writes(keys.size());
+  for (std::size_t i = 0; i < writes.size(); ++i) {
+    writes[i] = rng() % 100 < write_percent;
+  }
+
+  std::size_t i = 0;
+  std::size_t found = 0;
+  std::uint64_t next_id = n;
+  auto value = make<value_type>::from(0);
+  for (auto _ : state) {
+    auto slot = i++ & (keys.size() - 1);
+    if (writes[slot]) {
+      container.insert(key_for<Container, Dist>(next_id++), value);
+    } else {
+      found += container.contains(keys[slot]);
+    }
+  }
+  benchmark::DoNotOptimize(found);
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Heap bytes per entry after inserting n entries one at a time, in the
+// bytes_per_entry counter.
+template <typename Container, typename Dist>
+void memory(benchmark::State &state) {
+  auto n = static_cast<std::size_t>(state.range(0));
+  using value_type = typename Container::value_type;
+  auto ids = Dist::inserts(n);
+  for (auto _ : state) {
+    auto before = heap_in_use();
+    Container container;
+    for (auto id : ids) {
+      container.insert(key_for<Container, Dist>(id),
+                       make<value_type>::from(id));
+    }
+    auto after = heap_in_use();
+    state.counters["bytes_per_entry"] =
+        static_cast<double>(after - before) / n;
+  }
+}
+
+void sizes(benchmark::internal::Benchmark *b) {
+  b->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+}
+
+// Inserting into a sorted vector is quadratic, so keep it small.
+void small_sizes(benchmark::internal::Benchmark *b) {
+  b->RangeMultiplier(16)->Range(1 << 10, 1 << 16);
+}
+
+void scan_sizes(benchmark::internal::Benchmark *b) {
+  for (auto length : {10, 100, 1000}) {
+    b->Args({1 << 20, length});
+  }
+}
+
+// Memory is the same every time, so one build per size is enough.
+void memory_sizes(benchmark::internal::Benchmark *b) {
+  sizes(b);
+  b->Iterations(1);
+}
+
+void mixed_sizes(benchmark::internal::Benchmark *b) {
+  for (auto write_percent : {5, 50}) {
+    b->Args({1 << 20, write_percent});
+  }
+}
+
+} // namespace
+
+// Registers a workload for every container with int64 keys and values.
+#define AMIDVIDY_BENCH_I64(workload, dist, apply)                              \
+  BENCHMARK_TEMPLATE(workload, btree_16, dist)->Apply(apply);                  \
+  BENCHMARK_TEMPLATE(workload, btree_64, dist)->Apply(apply);                  \
+  BENCHMARK_TEMPLATE(workload, btree_128, dist)->Apply(apply);                 \
+  BENCHMARK_TEMPLATE(workload, btree_256, dist)->Apply(apply);                 \
+  BENCHMARK_TEMPLATE(workload, btree_512B, dist)->Apply(apply);                \
+  BENCHMARK_TEMPLATE(workload, btree_4KB, dist)->Apply(apply);                 \
+  BENCHMARK_TEMPLATE(workload, btree_auto, dist)->Apply(apply);                \
+  BENCHMARK_TEMPLATE(workload, map_i64, dist)->Apply(apply);                   \
+  BENCHMARK_TEMPLATE(workload, multimap_i64, dist)->Apply(apply)
+
+// The same for the wider value and string key variants.
+#define AMIDVIDY_BENCH_WIDE(workload, dist, apply)                             \
+  BENCHMARK_TEMPLATE(workload, btree_128_v64, dist)->Apply(apply);             \
+  BENCHMARK_TEMPLATE(workload, btree_auto_v64, dist)->Apply(apply);            \
+  BENCHMARK_TEMPLATE(workload, map_v64, dist)->Apply(apply);                   \
+  BENCHMARK_TEMPLATE(workload, btree_64_str, dist)->Apply(apply);              \
+  BENCHMARK_TEMPLATE(workload, map_str, dist)->Apply(apply)
+
+AMIDVIDY_BENCH_I64(insert, sequential, sizes);
+AMIDVIDY_BENCH_I64(insert, uniform, sizes);
+AMIDVIDY_BENCH_I64(insert, zipfian, sizes);
+AMIDVIDY_BENCH_WIDE(insert, uniform, sizes);
+BENCHMARK_TEMPLATE(insert, vector_i64, sequential)->Apply(small_sizes);
+BENCHMARK_TEMPLATE(insert, vector_i64, uniform)->Apply(small_sizes);
+
+AMIDVIDY_BENCH_I64(lookup_hit, uniform, sizes);
+AMIDVIDY_BENCH_I64(lookup_hit, zipfian, sizes);
+AMIDVIDY_BENCH_I64(lookup_miss, uniform, sizes);
+AMIDVIDY_BENCH_WIDE(lookup_hit, uniform, sizes);
+BENCHMARK_TEMPLATE(lookup_hit, vector_i64, uniform)->Apply(sizes);
+BENCHMARK_TEMPLATE(lookup_hit, vector_i64, zipfian)->Apply(sizes);
+BENCHMARK_TEMPLATE(lookup_miss, vector_i64, uniform)->Apply(sizes);
+
+AMIDVIDY_BENCH_I64(range_scan, uniform, scan_sizes);
+AMIDVIDY_BENCH_WIDE(range_scan, uniform, scan_sizes);
+BENCHMARK_TEMPLATE(range_scan, vector_i64, uniform)->Apply(scan_sizes);
+
+AMIDVIDY_BENCH_I64(mixed, uniform, mixed_sizes);
+AMIDVIDY_BENCH_I64(mixed, zipfian, mixed_sizes);
+
+AMIDVIDY_BENCH_I64(memory, uniform, memory_sizes);
+AMIDVIDY_BENCH_WIDE(memory, uniform, memory_sizes);
+BENCHMARK_TEMPLATE(memory, vector_i64, sequential)->Apply(memory_sizes);
+
+BENCHMARK_MAIN();
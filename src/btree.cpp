@@ -5,8 +5,14 @@
 
 #include "btree.hpp"
 
+struct map_policy : amidvidy::btree_policy {
+  static constexpr bool unique_keys = true;
+};
+
 int main() {
-  amidvidy::btree<std::int64_t, std::int64_t> bt;
+  amidvidy::btree<std::int64_t, std::int64_t, 0, std::less<std::int64_t>,
+                  map_policy>
+      bt;
 
   for (int i = 0; i < 10; ++i) {
     std::cout << "inserting: " << i << std::endl;
@@ -14,8 +20,8 @@ int main() {
     bt.print(std::cout);
   }
   for (int i = 0; i < 10; ++i) {
-    std::cout << "inserting: " << i << std::endl;
-    bt.insert(i, 2);
+    std::cout << "assigning: " << i << std::endl;
+    bt.insert_or_assign(i, 2);
     bt.print(std::cout);
   }
   // for (int i = 0; i < 10; ++i) {
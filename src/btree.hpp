@@ -1,40 +1,660 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <memory>
+#include <mutex>
 #include <tuple>
+#include <string>
+#include <utility>
 #include <iostream>
+#include <iterator>
+#include <stdexcept>
 #include <functional>
+#include <type_traits>
+
+#include "node_pool.hpp"
+#include "page_layout.hpp"
+#include "slot_array.hpp"
+#include "version_lock.hpp"
 
 namespace amidvidy {
+namespace detail {
+
+template <typename...> using void_t = void;
+
+// Whether a lookup can take a Q as the key: always for the key type itself,
+// and for anything else when the comparator is transparent (like std::less<>)
+// and so can compare it against keys directly.
+template <typename Compare, typename K, typename Q, typename = void>
+struct is_probe : std::is_same<K, Q> {};
+
+template <typename Compare, typename K, typename Q>
+struct is_probe<Compare, K, Q, void_t<typename Compare::is_transparent>>
+    : std::true_type {};
+
+// Holds the comparator. Comparators are usually empty, so where possible it
+// is a base class and takes no space.
+template <typename Compare, bool = std::is_empty<Compare>::value &&
+                                   !std::is_final<Compare>::value>
+class compare_holder : private Compare {
+public:
+  explicit compare_holder(const Compare &comp) : Compare(comp) {}
+
+  const Compare &compare() const { return *this; }
+};
+
+template <typename Compare> class compare_holder<Compare, false> {
+public:
+  explicit compare_holder(const Compare &comp) : _compare(comp) {}
+
+  const Compare &compare() const { return _compare; }
+
+private:
+  Compare _compare;
+};
+
+// Node sizing. Every node starts with a header of at most a cache line (lock,
+// kind, parent, owner, size and, for leaves, the sibling links); the rest of
+// the node budget goes to slots.
+constexpr std::size_t node_header_bytes = 64;
+
+// Picks a node size for entries of the given size: a power of two big enough
+// for about 60 entries per leaf, between 512B and 16KB. Small entries get
+// nodes of a few cache lines, which keep the in-node search short; big ones
+// get larger nodes, so that a leaf still holds enough entries to keep the
+// tree shallow.
+constexpr std::size_t default_node_bytes(std::size_t entry_bytes) {
+  std::size_t bytes = 512;
+  while (bytes < 16384 && bytes < node_header_bytes + 60 * entry_bytes) {
+    bytes *= 2;
+  }
+  return bytes;
+}
+
+// How many slots of `slot_bytes` fit in a node of `node_bytes` besides the
+// header and `extra_bytes`. Never fewer than three, the least a node can
+// split and merge with.
+constexpr std::size_t node_capacity(std::size_t node_bytes,
+                                    std::size_t slot_bytes,
+                                    std::size_t extra_bytes) {
+  auto overhead = node_header_bytes + extra_bytes;
+  auto slots = node_bytes > overhead ? (node_bytes - overhead) / slot_bytes : 0;
+  return slots < 3 ? 3 : slots;
+}
+
+// Stands in for btree_policy::aggregate when there is none.
+struct no_aggregate {
+  using result_type = no_aggregate;
+  static result_type identity() { return {}; }
+  template <typename K, typename V>
+  static result_type of(const K &, const V &) {
+    return {};
+  }
+  static result_type combine(result_type, result_type) { return {}; }
+};
+
+// The emplace_entry visitor for plain inserts.
+struct ignore_entry {
+  template <typename T> void operator()(T &, bool) const {}
+};
+
+} // namespace detail
+
+// Compile-time options for btree. To change one, derive from this and shadow
+// the member:
+//
+//   struct shared_index : amidvidy::btree_policy {
+//     static constexpr bool concurrent = true;
+//   };
+//   amidvidy::btree<std::int64_t, std::int64_t, 100, std::less<std::int64_t>,
+//                   shared_index> index;
+struct btree_policy {
+  // Makes insert and lookup safe to call from any number of threads at once.
+  // Every node carries a version lock; readers descend without taking locks
+  // and restart when a node they read changed underneath them, and writers
+  // lock only the nodes they modify. Keys and values must be trivially
+  // copyable, since a reader may copy one while it is being overwritten
+  // (and then throw the copy away). Everything else, including erase,
+  // bulk_load, clear and iteration, needs the tree to itself.
+  static constexpr bool concurrent = false;
+
+  // Backs the node pools with 2MiB transparent huge pages, which cuts TLB
+  // misses on big trees at the cost of reserving memory 2MiB at a time.
+  static constexpr bool huge_pages = false;
 
-template <typename K, typename V, std::size_t BucketSize = 100u,
-          typename Compare = std::less<K>>
-class btree {
+  // Target size of a node in bytes when btree's BucketSize is 0, e.g. 256
+  // or 512 to stay within a few cache lines, or 4096 for a page. Leaf and
+  // internal node capacities are worked out from it separately, since a
+  // leaf slot holds a key and a value and an internal one a key and a
+  // child pointer. 0 picks a size from the key and value sizes; see
+  // detail::default_node_bytes.
+  static constexpr std::size_t node_bytes = 0;
+
+  // The share of a full node's entries that stay in it when it splits, the
+  // rest moving to the new node on its right. 0.5 leaves both half full;
+  // higher values suit keys that mostly arrive in increasing order.
+  static constexpr float split_ratio = 0.5f;
+
+  // Splits the last leaf at its end when the new key goes after everything
+  // in it, and so on up the rightmost path, so that appending keys in
+  // increasing order (timestamps, sequence numbers) leaves nodes full rather
+  // than half empty. Such inserts also skip the descent, going straight to
+  // the last leaf while they keep arriving in order.
+  static constexpr bool append_split = true;
+
+  // Makes iterators throw std::out_of_range when dereferenced or moved past
+  // either end of the tree, instead of reading out of bounds. It costs a
+  // couple of compares and a branch per step, which shows in scans. Off
+  // unless asked for, whatever the build: being part of the policy, and so
+  // of the tree's type, a checked tree is never mixed up with an unchecked
+  // one, even between translation units built with and without NDEBUG.
+  static constexpr bool checked_iterators = false;
+
+  // Keeps at most one entry per key, like std::map rather than
+  // std::multimap. insert and emplace then leave the tree alone when the key
+  // is already there, and say so by returning (iterator, bool).
+  static constexpr bool unique_keys = false;
+
+  // Has internal nodes keep the number of entries under each child, next
+  // to the child pointer. That makes rank, select and count O(log n) rather
+  // than walks over the entries, at the price of a count to update on every
+  // level per insert and erase, and somewhat fewer keys per internal node.
+  // Not available in concurrent mode, where writers only lock the leaf.
+  static constexpr bool order_statistics = false;
+
+  // An associative operation over entries whose result internal nodes keep
+  // for each child's subtree, like the counts above, so that aggregate(lo,
+  // hi) combines a few stored results rather than visiting every entry in
+  // the range. void for none; otherwise a type with static members like
+  // these, which sum the values:
+  //
+  //   struct sum_of_values {
+  //     using result_type = std::int64_t;
+  //     static result_type identity() { return 0; }
+  //     static result_type of(const std::int64_t &key,
+  //                           const std::int64_t &value) {
+  //       return value;
+  //     }
+  //     static result_type combine(const result_type &a,
+  //                                const result_type &b) {
+  //       return a + b;
+  //     }
+  //   };
+  //
+  // Results are always combined in key order, so combine need not be
+  // commutative. Each insert and erase works out the results on its path to
+  // the root again, going over a leaf and one node per level. Not available
+  // in concurrent mode either.
+  using aggregate = void;
+};
+
+// BucketSize, if not 0, fixes both the number of entries in a leaf and the
+// number of keys in an internal node, whatever their size, and must then be
+// at least 3. By default node capacities are derived from Policy::node_bytes
+// instead.
+template <typename K, typename V, std::size_t BucketSize = 0,
+          typename Compare = std::less<K>, typename Policy = btree_policy>
+class btree : private detail::compare_holder<Compare> {
   class node;
   class leaf_node;
   class internal_node;
 
+  // The least a node can split and merge with; see detail::node_capacity.
+  static_assert(BucketSize == 0 || BucketSize >= 3,
+                "BucketSize must be 0 or at least 3");
+  static_assert(!Policy::concurrent ||
+                    (std::is_trivially_copyable<K>::value &&
+                     std::is_trivially_copyable<V>::value),
+                "concurrent btrees need trivially copyable keys and values");
+  // See btree_policy::aggregate.
+  static constexpr bool aggregating =
+      !std::is_void<typename Policy::aggregate>::value;
+  using aggregate_ops =
+      std::conditional_t<aggregating, typename Policy::aggregate,
+                         detail::no_aggregate>;
+
+  static_assert(!Policy::concurrent ||
+                    (!Policy::order_statistics && !aggregating),
+                "order statistics and aggregates are not supported in "
+                "concurrent mode");
+
+  // What an internal node keeps per child besides the key.
+  static constexpr std::size_t child_slot_bytes =
+      sizeof(void *) + (Policy::order_statistics ? sizeof(std::size_t) : 0) +
+      (aggregating ? sizeof(typename aggregate_ops::result_type) : 0);
+
+  // Q is the type of a key passed to a lookup. See is_probe.
+  template <typename Q, typename R>
+  using if_probe = std::enable_if_t<detail::is_probe<Compare, K, Q>::value, R>;
+
 public:
+  static constexpr std::size_t node_bytes =
+      Policy::node_bytes ? Policy::node_bytes
+                         : detail::default_node_bytes(sizeof(K) + sizeof(V));
+
+  // Entries per leaf.
+  static constexpr std::size_t leaf_capacity =
+      BucketSize ? BucketSize
+                 : detail::node_capacity(node_bytes, sizeof(K) + sizeof(V), 0);
+
+  // Keys per internal node, which has one more child than that.
+  static constexpr std::size_t internal_capacity =
+      BucketSize ? BucketSize
+                 : detail::node_capacity(node_bytes,
+                                         sizeof(K) + child_slot_bytes,
+                                         child_slot_bytes);
+
   btree();
+  explicit btree(const Compare &comp);
+
+  // Builds the tree from a range of (key, value) pairs or tuples already
+  // sorted by key. See bulk_load.
+  template <typename InputIt>
+  btree(InputIt first, InputIt last, float fill = 1.0f,
+        const Compare &comp = Compare());
 
   using key_type = K;
   using value_type = V;
+  using key_compare = Compare;
   using item_type = std::tuple<key_type, value_type>;
+  // What dereferencing an iterator gives: the key and value in place.
+  using reference = std::tuple<const key_type &, value_type &>;
+  using const_reference = std::tuple<const key_type &, const value_type &>;
+  // What aggregate returns. See btree_policy::aggregate.
+  using aggregate_type = typename aggregate_ops::result_type;
 
+  // Bidirectional. Inserts and erases invalidate iterators, end() included.
   class iterator;
+  class const_iterator;
+  using reverse_iterator = std::reverse_iterator<iterator>;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  // What insert and emplace return: with unique keys, the entry with the key
+  // and whether it was added, as for std::map; otherwise just the new entry.
+  using insert_result = std::conditional_t<Policy::unique_keys,
+                                           std::pair<iterator, bool>, iterator>;
+
+  // In concurrent mode the returned iterators are only hints: other writers
+  // may have moved the entry by the time they are used.
+
+  // Adds an entry, after any others with the same key or, with unique keys,
+  // only if there are none. Rvalues are moved into the leaf rather than
+  // copied. Either may refer to an entry of this tree.
+  template <typename KArg, typename VArg,
+            typename = std::enable_if_t<
+                std::is_convertible<KArg &&, key_type>::value &&
+                std::is_convertible<VArg &&, value_type>::value>>
+  insert_result insert(KArg &&key, VArg &&value) {
+    return emplace(std::forward<KArg>(key), std::forward<VArg>(value));
+  }
+
+  // Like insert, but the value is constructed from `args`. Key and value are
+  // built before any entry moves to make room, so the arguments may refer
+  // to entries of this tree, and are then moved into their slot.
+  template <typename... Args>
+  insert_result emplace(const key_type &key, Args &&... args) {
+    return make_insert_result(
+        emplace_entry<Policy::unique_keys>(detail::ignore_entry(), key,
+                                           std::forward<Args>(args)...));
+  }
+  template <typename... Args>
+  insert_result emplace(key_type &&key, Args &&... args) {
+    return make_insert_result(emplace_entry<Policy::unique_keys>(
+        detail::ignore_entry(), std::move(key), std::forward<Args>(args)...));
+  }
+
+  // Like emplace, unless there already is an entry with the key, in which
+  // case nothing is constructed and that entry is returned with false.
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(const key_type &key, Args &&... args) {
+    return emplace_entry<true>(detail::ignore_entry(), key,
+                               std::forward<Args>(args)...);
+  }
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(key_type &&key, Args &&... args) {
+    return emplace_entry<true>(detail::ignore_entry(), std::move(key),
+                               std::forward<Args>(args)...);
+  }
+
+  // The updates below find the entry with the key and add it if there is
+  // none in one descent, so in concurrent mode nothing can get in between.
+  // With duplicate keys only one of the entries is updated.
+
+  // Adds the entry, or assigns the value to the one already there. The
+  // bool says whether it was added.
+  template <typename VArg>
+  std::pair<iterator, bool> insert_or_assign(const key_type &key,
+                                             VArg &&value) {
+    return emplace_entry<true>(assign_entry<VArg>{value}, key,
+                               std::forward<VArg>(value));
+  }
+  template <typename VArg>
+  std::pair<iterator, bool> insert_or_assign(key_type &&key, VArg &&value) {
+    return emplace_entry<true>(assign_entry<VArg>{value}, std::move(key),
+                               std::forward<VArg>(value));
+  }
 
-  iterator insert(key_type key, value_type value);
+  // Calls f(value) on the value of the entry with the key, adding one with
+  // a value initialized value first if there is none. The bool says whether
+  // it was added. In concurrent mode f runs with the leaf locked, so it
+  // should be short.
+  template <typename F>
+  std::pair<iterator, bool> upsert(const key_type &key, F &&f) {
+    return emplace_entry<true>(update_entry<F>{f}, key);
+  }
+  template <typename F>
+  std::pair<iterator, bool> upsert(key_type &&key, F &&f) {
+    return emplace_entry<true>(update_entry<F>{f}, std::move(key));
+  }
+
+  // The first entry with a key not less than this one; same as lower_bound.
   iterator search(key_type key);
 
+  // The lookups below also come as templates that, when Compare is
+  // transparent, take any type it can compare against keys, so that for
+  // instance std::string keys can be looked up by std::string_view without
+  // building a string.
+
+  // An entry with exactly this key (the first, if there are several), or
+  // end().
+  iterator find(const key_type &key) { return find<key_type>(key); }
+  template <typename Q> if_probe<Q, iterator> find(const Q &key);
+
+  // Range queries. Each descends the tree once; equal_range usually finds its
+  // upper end in the leaf it landed in.
+  iterator lower_bound(const key_type &key) {
+    return lower_bound<key_type>(key);
+  }
+  template <typename Q> if_probe<Q, iterator> lower_bound(const Q &key);
+
+  iterator upper_bound(const key_type &key) {
+    return upper_bound<key_type>(key);
+  }
+  template <typename Q> if_probe<Q, iterator> upper_bound(const Q &key);
+
+  std::pair<iterator, iterator> equal_range(const key_type &key) {
+    return equal_range<key_type>(key);
+  }
+  template <typename Q>
+  if_probe<Q, std::pair<iterator, iterator>> equal_range(const Q &key);
+
+  // Calls f(key, value) for every entry with lo <= key < hi, in order, and
+  // returns how many entries were visited. If f returns something other
+  // than void, the scan stops as soon as it returns false. Cheaper than
+  // iterating, since it walks each leaf's arrays directly.
+  template <typename F>
+  std::size_t scan(const key_type &lo, const key_type &hi, F &&f) {
+    return scan<key_type, key_type>(lo, hi, std::forward<F>(f));
+  }
+  template <typename Q, typename R, typename F>
+  if_probe<Q, if_probe<R, std::size_t>> scan(const Q &lo, const R &hi, F &&f);
+
+  // The number of entries. With order statistics this adds up the counts in
+  // the root; otherwise it walks the leaves.
+  std::size_t size() const;
+
+  bool empty() const;
+
+  // Order statistics, which need Policy::order_statistics. Each descends the
+  // tree once, adding up the counts of the subtrees it passes by.
+
+  // How many entries have keys less than this one; the position of
+  // lower_bound(key) in the tree.
+  std::size_t rank(const key_type &key) { return rank<key_type>(key); }
+  template <typename Q> if_probe<Q, std::size_t> rank(const Q &key);
+
+  // The entry at this position in key order (0 being the first), or end()
+  // if there are not that many entries.
+  iterator select(std::size_t position);
+
+  // How many entries have lo <= key < hi; what scan(lo, hi, f) would visit.
+  std::size_t count(const key_type &lo, const key_type &hi) {
+    return count<key_type, key_type>(lo, hi);
+  }
+  template <typename Q, typename R>
+  if_probe<Q, if_probe<R, std::size_t>> count(const Q &lo, const R &hi);
+
+  // The aggregate (see btree_policy::aggregate) of the entries with
+  // lo <= key < hi. Whole subtrees inside the range contribute the results
+  // kept for them, so only the entries in the two leaves at its ends are
+  // visited.
+  aggregate_type aggregate(const key_type &lo, const key_type &hi) {
+    return aggregate<key_type, key_type>(lo, hi);
+  }
+  template <typename Q, typename R>
+  if_probe<Q, if_probe<R, aggregate_type>> aggregate(const Q &lo,
+                                                     const R &hi);
+
+  // With an aggregate, a value changed in place, through an iterator or in
+  // scan, must be followed by a call to this with its entry so that the
+  // results kept above it are worked out again. insert_or_assign and upsert
+  // do that themselves.
+  void refresh(iterator pos);
+
+  // Batched searches: write what search() (or find()) would return for each
+  // key in [first, last) to `out`, in order, and return the end of the
+  // output. Groups of keys descend together level by level, each one
+  // prefetching its next node before the others take their step, so the
+  // cache misses of a group overlap instead of adding up. Worth it for many
+  // keys at once in trees that do not fit in cache. Like iteration, they
+  // need the tree to themselves in concurrent mode.
+  template <typename ForwardIt, typename OutputIt>
+  OutputIt multi_search(ForwardIt first, ForwardIt last, OutputIt out) {
+    return batch_search<false>(first, last, out);
+  }
+  template <typename ForwardIt, typename OutputIt>
+  OutputIt multi_find(ForwardIt first, ForwardIt last, OutputIt out) {
+    return batch_search<true>(first, last, out);
+  }
+
+  // Inserts a range of (key, value) pairs or tuples in any order and returns
+  // how many entries were added; with unique keys, the first of several
+  // entries with the same key wins. The entries are sorted, unless they
+  // already are, and merged into the tree a leaf at a time: one descent per
+  // leaf they land in, and each entry already in that leaf moved once. Much
+  // cheaper than separate inserts when entries share leaves. In concurrent
+  // mode the entries are inserted one at a time.
+  template <typename InputIt>
+  std::size_t insert_batch(InputIt first, InputIt last);
+
+  // Copies the value of an entry with the key into `value`. Returns false,
+  // leaving `value` alone, if there is none. Safe to call concurrently with
+  // inserts in concurrent mode.
+  bool lookup(const key_type &key, value_type &value) {
+    return lookup<key_type>(key, value);
+  }
+  template <typename Q>
+  if_probe<Q, bool> lookup(const Q &key, value_type &value);
+
+  key_compare key_comp() const { return this->compare(); }
+
+  // Replaces the contents of the tree with a range of (key, value) pairs or
+  // tuples that is already sorted by key. Nodes are packed left to right to
+  // `fill` of their capacity and the internal levels are built bottom-up, so
+  // there are no searches and no splits. A fill below 1 leaves room for later
+  // inserts before nodes have to split.
+  template <typename InputIt>
+  void bulk_load(InputIt first, InputIt last, float fill = 1.0f);
+
+  // Removes everything.
+  void clear();
+
+  // Writes the tree to a file at `path` that mapped_btree can map and
+  // search in place, replacing any file there once the new one is on disk.
+  // Leaves are packed into PageBytes pages with the internal levels above
+  // them, and nodes refer to each other by page number, so the file reads
+  // the same wherever it is mapped. paged_btree can open it too. Keys and
+  // values are written as their bytes, so both must be trivially copyable.
+  // Throws std::system_error if the file cannot be written.
+  template <std::size_t PageBytes = 4096>
+  void save(const std::string &path) const;
+
+  // Removes every entry with the key and returns how many there were.
+  std::size_t erase(const key_type &key);
+  // Both return an iterator to the entry after the last one removed.
+  iterator erase(iterator pos);
+  iterator erase(iterator first, iterator last);
+
+  // After an erase, a node left with fewer entries than this fraction of its
+  // capacity borrows from or merges with a sibling. Lower values mean less
+  // rebalancing work and sparser nodes; 0 only frees nodes once they are
+  // empty. Capped at 0.5, since two underfull nodes must fit in one.
+  float min_fill() const { return _min_fill; }
+  void set_min_fill(float min_fill);
+
   iterator end();
   iterator begin();
+  const_iterator begin() const { return const_cast<btree *>(this)->begin(); }
+  const_iterator end() const { return const_cast<btree *>(this)->end(); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+
+  // Iterate from the largest key down. reverse_iterator(upper_bound(k))
+  // starts at the last entry with key k or below.
+  reverse_iterator rbegin() { return reverse_iterator(end()); }
+  reverse_iterator rend() { return reverse_iterator(begin()); }
+  const_reverse_iterator rbegin() const {
+    return const_reverse_iterator(end());
+  }
+  const_reverse_iterator rend() const {
+    return const_reverse_iterator(begin());
+  }
+  const_reverse_iterator crbegin() const { return rbegin(); }
+  const_reverse_iterator crend() const { return rend(); }
 
   // For debugging.
   std::ostream &print(std::ostream &os);
 
 private:
-  std::unique_ptr<node> _root;
+  // Nodes have no vtable, so they are destroyed through their kind tag.
+  struct node_deleter {
+    void operator()(node *n) const;
+  };
+
+  using node_ptr = std::unique_ptr<node, node_deleter>;
+
+  using lock_type = std::conditional_t<Policy::concurrent,
+                                       detail::optimistic_lock,
+                                       detail::no_lock>;
+
+  // Concurrent inserts split, and so allocate, in parallel.
+  using pool_type = detail::node_pool<std::conditional_t<
+      Policy::concurrent, std::mutex, detail::null_mutex>>;
+
+  // Nodes live in the tree's own pools; node_deleter hands them back.
+  leaf_node *new_leaf();
+  internal_node *new_internal();
+
+  // Adds an entry whose value is constructed from `args`, or if Unique and
+  // the key is already there, returns that entry with false. Either way it
+  // then calls visit(value, added) on the entry's value, with the leaf still
+  // locked in concurrent mode.
+  template <bool Unique, typename Visit, typename KArg, typename... Args>
+  std::pair<iterator, bool> emplace_entry(Visit visit, KArg &&key,
+                                          Args &&... args) {
+    return emplace_entry<Unique>(
+        std::integral_constant<bool, Policy::concurrent>(), visit,
+        std::forward<KArg>(key), std::forward<Args>(args)...);
+  }
+  template <bool Unique, typename Visit, typename KArg, typename... Args>
+  std::pair<iterator, bool> emplace_entry(std::false_type, Visit visit,
+                                          KArg &&key, Args &&... args);
+  template <bool Unique, typename Visit, typename KArg, typename... Args>
+  std::pair<iterator, bool> emplace_entry(std::true_type, Visit visit,
+                                          KArg &&key, Args &&... args);
+
+  // emplace_entry visitors for insert_or_assign and upsert.
+  template <typename VArg> struct assign_entry {
+    void operator()(value_type &value, bool added) const {
+      if (!added) {
+        value = std::forward<VArg>(_value);
+      }
+    }
+    VArg &_value;
+  };
+
+  template <typename F> struct update_entry {
+    void operator()(value_type &value, bool) const { _f(value); }
+    F &_f;
+  };
+
+  static iterator make_insert_result(std::pair<iterator, bool> result,
+                                     std::false_type) {
+    return result.first;
+  }
+  static std::pair<iterator, bool>
+  make_insert_result(std::pair<iterator, bool> result, std::true_type) {
+    return result;
+  }
+  static insert_result make_insert_result(std::pair<iterator, bool> result) {
+    return make_insert_result(
+        result, std::integral_constant<bool, Policy::unique_keys>());
+  }
+
+  template <typename Q> leaf_node *find_leaf(const Q &key);
+
+  // Also points `fence` at the separator right of the leaf, which no key in
+  // it reaches, or sets it to null for the last leaf.
+  template <typename Q>
+  leaf_node *find_leaf(const Q &key, const key_type *&fence);
+
+  template <typename InputIt>
+  std::size_t insert_batch(InputIt first, InputIt last,
+                           std::input_iterator_tag);
+  template <typename ForwardIt>
+  std::size_t insert_batch(ForwardIt first, ForwardIt last,
+                           std::forward_iterator_tag);
+
+  // insert_batch for entries sorted by key.
+  template <typename ForwardIt>
+  std::size_t insert_sorted(ForwardIt first, ForwardIt last);
+
+  // multi_search, or with Find, multi_find.
+  template <bool Find, typename ForwardIt, typename OutputIt>
+  OutputIt batch_search(ForwardIt first, ForwardIt last, OutputIt out);
+
+  // How many of the entries (or children) of a full node of this size stay
+  // in it when it splits. See btree_policy::split_ratio and append_split.
+  static std::size_t split_point(std::size_t size, bool append);
+
+  // The fewest entries (or children) a node with this capacity may have.
+  std::size_t min_entries(std::size_t capacity) const;
+
+  // Puts a new internal root above the current one, with `right` (split off
+  // the old root) as its second child.
+  void grow_root(key_type separator, node_ptr right);
+
+  // Replaces an internal root that has a single child with that child.
+  void collapse_root();
+
+  // Brings the summaries of every subtree the node is in (see
+  // internal_node::_counts) up to date after `added` entries were added to
+  // it, or removed if negative, or its values changed. Leaves call this
+  // whenever that happens other than by moving entries to or from a
+  // sibling.
+  void update_summaries(node *n, std::ptrdiff_t added);
+
+  // The aggregate of the entries under n from *lo up to *hi, where a null
+  // bound leaves that end open.
+  template <typename Q, typename R>
+  aggregate_type aggregate_range(node *n, const Q *lo, const R *hi);
+
+  // Concurrent readers find the root through _current_root, since _root
+  // itself is not safe to read while a writer replaces it.
+  node *root() const;
+  void set_root(node_ptr root);
+
+  // Declared ahead of _root so that they outlive the nodes.
+  pool_type _leaf_pool;
+  pool_type _internal_pool;
+  node_ptr _root;
+  std::atomic<node *> _current_root;
+  // The last leaf, and whether the last insert went there, in which case
+  // the next one tries it before descending.
+  leaf_node *_rightmost;
+  bool _appending = false;
+  float _min_fill = 0.25f;
 };
 
 } // namespace amidvidy
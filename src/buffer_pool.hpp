@@ -0,0 +1,399 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace amidvidy {
+namespace detail {
+
+// Pages are numbered from 0, their offset in the file over the page size.
+using page_id = std::uint64_t;
+
+[[noreturn]] inline void throw_errno(const std::string &what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+// A file read and written at byte offsets, with retries on short reads and
+// writes and on EINTR, and errors thrown as std::system_error.
+class file {
+public:
+  explicit file(const std::string &path) {
+    _fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (_fd < 0) {
+      throw_errno("open " + path);
+    }
+  }
+
+  file(const file &) = delete;
+  file &operator=(const file &) = delete;
+
+  ~file() { ::close(_fd); }
+
+  std::uint64_t bytes() const {
+    struct stat st;
+    if (::fstat(_fd, &st) != 0) {
+      throw_errno("fstat");
+    }
+    return static_cast<std::uint64_t>(st.st_size);
+  }
+
+  // Reads up to `bytes` bytes, fewer only at the end of the file, and
+  // returns how many were read.
+  std::size_t read_at(std::uint64_t offset, void *buffer, std::size_t bytes) {
+    auto p = static_cast<char *>(buffer);
+    std::size_t done = 0;
+    while (done < bytes) {
+      auto n = ::pread(_fd, p + done, bytes - done,
+                       static_cast<off_t>(offset + done));
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw_errno("pread");
+      }
+      if (n == 0) {
+        break;
+      }
+      done += n;
+    }
+    return done;
+  }
+
+  void write_at(std::uint64_t offset, const void *buffer, std::size_t bytes) {
+    auto p = static_cast<const char *>(buffer);
+    for (std::size_t done = 0; done < bytes;) {
+      auto n = ::pwrite(_fd, p + done, bytes - done,
+                        static_cast<off_t>(offset + done));
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw_errno("pwrite");
+      }
+      done += n;
+    }
+  }
+
+  // Cuts the file down (or extends it) to this many bytes.
+  void truncate(std::uint64_t bytes) {
+    if (::ftruncate(_fd, static_cast<off_t>(bytes)) != 0) {
+      throw_errno("ftruncate");
+    }
+  }
+
+  // Waits for everything written so far to reach the disk.
+  void sync() {
+    if (::fsync(_fd) != 0) {
+      throw_errno("fsync");
+    }
+  }
+
+  // Like sync, but skips metadata such as the modification time that is not
+  // needed to read the data back, which saves a write on most filesystems
+  // when the file did not grow.
+  void sync_data() {
+    if (::fdatasync(_fd) != 0) {
+      throw_errno("fdatasync");
+    }
+  }
+
+private:
+  int _fd;
+};
+
+// A file of fixed-size pages, read and written a whole page at a time.
+class page_file {
+public:
+  page_file(const std::string &path, std::size_t page_bytes)
+      : _file(path), _page_bytes(page_bytes) {}
+
+  std::size_t page_bytes() const { return _page_bytes; }
+
+  // Whole pages in the file.
+  page_id pages() const { return _file.bytes() / _page_bytes; }
+
+  void read(page_id id, void *buffer) {
+    if (_file.read_at(offset(id), buffer, _page_bytes) < _page_bytes) {
+      throw std::runtime_error("page_file: page past the end of the file");
+    }
+  }
+
+  void write(page_id id, const void *buffer) {
+    _file.write_at(offset(id), buffer, _page_bytes);
+  }
+
+  // Cuts the file down (or extends it) to this many pages.
+  void truncate(page_id pages) { _file.truncate(offset(pages)); }
+
+  void sync() { _file.sync(); }
+
+private:
+  std::uint64_t offset(page_id id) const { return id * _page_bytes; }
+
+  file _file;
+  std::size_t _page_bytes;
+};
+
+class buffer_pool;
+
+// A pinned page of a buffer_pool. The page stays in memory, at the same
+// address, for as long as some page_ref to it is around; copies pin it
+// again. Whoever changes the page must call mark_dirty so that it is written
+// back before its frame is reused.
+class page_ref {
+public:
+  page_ref() = default;
+
+  page_ref(const page_ref &other);
+  page_ref(page_ref &&other) noexcept
+      : _pool(other._pool), _frame(other._frame) {
+    other._pool = nullptr;
+  }
+
+  page_ref &operator=(page_ref other) noexcept {
+    std::swap(_pool, other._pool);
+    std::swap(_frame, other._frame);
+    return *this;
+  }
+
+  ~page_ref() { reset(); }
+
+  // Unpins the page.
+  void reset();
+
+  explicit operator bool() const { return _pool; }
+
+  // 0 when empty. Page 0 is never a node, so that works as "no page".
+  page_id id() const;
+
+  void *data() const;
+
+  template <typename T> T *as() const { return static_cast<T *>(data()); }
+
+  void mark_dirty() const;
+
+private:
+  friend class buffer_pool;
+
+  page_ref(buffer_pool *pool, std::size_t frame)
+      : _pool(pool), _frame(frame) {}
+
+  buffer_pool *_pool = nullptr;
+  std::size_t _frame = 0;
+};
+
+// Caches the pages of a page_file in a fixed number of page-sized frames,
+// which bounds the memory a paged tree uses however big its file grows.
+//
+// Only unpinned pages are evicted. The victim is picked by the clock
+// algorithm: a hand sweeps the frames and takes the first page not used
+// since it last came by, clearing the reference bit of those that were, so
+// that pages in steady use (the top levels of a tree) stay while a scan's
+// leaves come and go. Dirty pages are written back when evicted and on
+// flush, never otherwise, and with write-back off, only on flush.
+class buffer_pool {
+public:
+  buffer_pool(page_file &file, std::size_t frames)
+      : _file(file), _page_bytes(file.page_bytes()), _frames(frames) {
+    // Page aligned, which is also what O_DIRECT would want.
+    if (posix_memalign(reinterpret_cast<void **>(&_memory), 4096,
+                       frames * _page_bytes) != 0) {
+      throw std::bad_alloc();
+    }
+    _table.reserve(frames);
+  }
+
+  buffer_pool(const buffer_pool &) = delete;
+  buffer_pool &operator=(const buffer_pool &) = delete;
+
+  // Does not write anything back; flush first.
+  ~buffer_pool() { std::free(_memory); }
+
+  // Pins the page, reading it in if it is not cached.
+  page_ref pin(page_id id) {
+    auto found = _table.find(id);
+    if (found != _table.end()) {
+      auto &f = _frames[found->second];
+      ++f.pins;
+      f.referenced = true;
+      return page_ref(this, found->second);
+    }
+    auto index = victim();
+    try {
+      _file.read(id, frame_data(index));
+    } catch (...) {
+      _frames[index].used = false;
+      throw;
+    }
+    return install(index, id, false);
+  }
+
+  // Pins a page that is not in the file yet, zero filled and dirty, without
+  // reading anything.
+  page_ref pin_new(page_id id) {
+    auto index = victim();
+    std::memset(frame_data(index), 0, _page_bytes);
+    return install(index, id, true);
+  }
+
+  // Writes every dirty page back.
+  void flush() {
+    for (std::size_t i = 0; i < _frames.size(); ++i) {
+      auto &f = _frames[i];
+      if (f.used && f.dirty) {
+        _file.write(f.id, frame_data(i));
+        f.dirty = false;
+        --_dirty;
+      }
+    }
+  }
+
+  // Whether evicting a dirty page writes it back. With write-back off,
+  // dirty pages stay in memory until flush, so the file does not change in
+  // between, and pinning throws when every frame is pinned or dirty. A
+  // write-ahead log relies on that to keep the file at its last checkpoint.
+  void set_write_back(bool write_back) { _write_back = write_back; }
+
+  std::size_t dirty_pages() const { return _dirty; }
+
+  // Calls f(id, data) for every dirty page.
+  template <typename F> void for_each_dirty(F &&f) {
+    for (std::size_t i = 0; i < _frames.size(); ++i) {
+      if (_frames[i].used && _frames[i].dirty) {
+        f(_frames[i].id, static_cast<const void *>(frame_data(i)));
+      }
+    }
+  }
+
+  // Drops every change not written back yet, and every unpinned page, so
+  // that the pool holds nothing that is not in the file.
+  void discard() {
+    for (auto &f : _frames) {
+      f.dirty = false;
+      if (f.used && !f.pins) {
+        _table.erase(f.id);
+        f.used = false;
+      }
+    }
+    _dirty = 0;
+  }
+
+  std::size_t frames() const { return _frames.size(); }
+
+private:
+  friend class page_ref;
+
+  struct frame {
+    page_id id = 0;
+    std::size_t pins = 0;
+    bool used = false;
+    bool dirty = false;
+    bool referenced = false;
+  };
+
+  char *frame_data(std::size_t index) {
+    return _memory + index * _page_bytes;
+  }
+
+  page_ref install(std::size_t index, page_id id, bool dirty) {
+    auto &f = _frames[index];
+    f.id = id;
+    f.pins = 1;
+    f.used = true;
+    f.dirty = dirty;
+    f.referenced = true;
+    _dirty += dirty;
+    _table.emplace(id, index);
+    return page_ref(this, index);
+  }
+
+  // A frame to load a page into, free or evicted from. Two sweeps are enough
+  // to find one if any page can go (is unpinned, and clean if write-back is
+  // off): the first clears every reference bit it passes.
+  std::size_t victim() {
+    for (std::size_t step = 0; step < 2 * _frames.size(); ++step) {
+      auto index = _hand;
+      _hand = (_hand + 1) % _frames.size();
+      auto &f = _frames[index];
+      if (!f.used) {
+        return index;
+      }
+      if (f.pins) {
+        continue;
+      }
+      if (f.referenced) {
+        f.referenced = false;
+        continue;
+      }
+      if (f.dirty) {
+        if (!_write_back) {
+          continue;
+        }
+        _file.write(f.id, frame_data(index));
+        f.dirty = false;
+        --_dirty;
+      }
+      _table.erase(f.id);
+      f.used = false;
+      return index;
+    }
+    throw std::runtime_error(_write_back
+                                 ? "buffer_pool: every page is pinned"
+                                 : "buffer_pool: every page is pinned or "
+                                   "dirty");
+  }
+
+  page_file &_file;
+  std::size_t _page_bytes;
+  char *_memory = nullptr;
+  std::vector<frame> _frames;
+  std::unordered_map<page_id, std::size_t> _table;
+  std::size_t _hand = 0;
+  std::size_t _dirty = 0;
+  bool _write_back = true;
+};
+
+inline page_ref::page_ref(const page_ref &other)
+    : _pool(other._pool), _frame(other._frame) {
+  if (_pool) {
+    ++_pool->_frames[_frame].pins;
+  }
+}
+
+inline void page_ref::reset() {
+  if (_pool) {
+    --_pool->_frames[_frame].pins;
+    _pool = nullptr;
+  }
+}
+
+inline page_id page_ref::id() const {
+  return _pool ? _pool->_frames[_frame].id : 0;
+}
+
+inline void *page_ref::data() const { return _pool->frame_data(_frame); }
+
+inline void page_ref::mark_dirty() const {
+  auto &f = _pool->_frames[_frame];
+  if (!f.dirty) {
+    f.dirty = true;
+    ++_pool->_dirty;
+  }
+}
+
+} // namespace detail
+} // namespace amidvidy
@@ -0,0 +1,431 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "paged_btree.hpp"
+#include "write_ahead_log.hpp"
+
+namespace amidvidy {
+
+// How often durable_btree syncs its log and checkpoints.
+struct durability_options {
+  // Records per log sync. Higher values mean fewer syncs per insert, but
+  // more of the latest changes lost in a crash: up to group_commit - 1 of
+  // them. 1 syncs every change before it returns.
+  std::size_t group_commit = 256;
+
+  // How long a change can wait for the rest of its group: the change that
+  // finds the oldest uncommitted one this old syncs the group early. This
+  // is checked on changes only, with no timer, so a group that is never
+  // completed stays unsynced until commit(), a checkpoint or the tree's
+  // destruction, and a crash before then loses it, however old it is.
+  std::chrono::milliseconds group_commit_delay{10};
+
+  // Log size that triggers a checkpoint, which bounds how much a recovery
+  // has to replay.
+  std::uint64_t checkpoint_log_bytes = 64 << 20;
+};
+
+// A paged_btree that survives crashes. Changes are appended to a
+// write-ahead log next to the tree file (at path + ".wal") before they are
+// made, and the log is synced a group of changes at a time (see
+// durability_options::group_commit), so durability costs a sequential
+// append per change and a sync per group, rather than page writes. The
+// last group is synced only when it fills up, when a change comes after
+// group_commit_delay, or on commit(); call commit() after a batch of
+// changes that must not be lost.
+//
+// Changed pages stay in the buffer pool until a checkpoint, which happens
+// when half of the pool is dirty, when the log grows past
+// checkpoint_log_bytes, on checkpoint() and when the tree is destroyed. It
+// writes the changed pages to a journal (path + ".journal") and syncs it
+// before writing them in place, so a crash in the middle leaves either the
+// journal or the old pages intact. Then the log starts over. An erase that
+// runs through more leaves than the pool has room for writes its pages the
+// same way between leaves, but keeps the log: the tree file's header only
+// ever counts changes applied in full as checkpointed, and erasing a key
+// again is harmless.
+//
+// Opening the tree recovers from a crash: a complete journal is written to
+// the tree file again, and the changes logged after the checkpoint it
+// belongs to are replayed. The changes not yet committed when the crash
+// happened are lost; everything before them is there.
+//
+// If a change throws, the changes since the last checkpoint are dropped
+// from memory, and everything but destroying the tree throws from then on.
+// Opening it again replays them from the log.
+//
+// The interface is paged_btree's.
+template <typename K, typename V, std::size_t PageBytes = 4096,
+          typename Compare = std::less<K>>
+class durable_btree {
+  using tree_type = paged_btree<K, V, PageBytes, Compare>;
+
+public:
+  using key_type = K;
+  using value_type = V;
+  using key_compare = Compare;
+  using reference = typename tree_type::reference;
+  using iterator = typename tree_type::iterator;
+
+  // The pool needs room for the dirty pages of a checkpoint's worth of
+  // changes besides the pages that reads pin, so it never gets smaller
+  // than this.
+  static constexpr std::size_t min_cached_pages = 64;
+
+  // Opens the tree at `path`, creating it if there is none, and recovers it
+  // from a crash if need be.
+  durable_btree(const std::string &path, std::size_t cache_bytes,
+                const durability_options &options = durability_options(),
+                const Compare &comp = Compare());
+
+  // Checkpoints, or after a failed change, only commits the log.
+  ~durable_btree();
+
+  durable_btree(const durable_btree &) = delete;
+  durable_btree &operator=(const durable_btree &) = delete;
+
+  // Adds an entry, after any others with the same key.
+  void insert(const key_type &key, const value_type &value);
+
+  // Removes every entry with the key and returns how many there were.
+  std::size_t erase(const key_type &key);
+
+  bool lookup(const key_type &key, value_type &value) {
+    return tree().lookup(key, value);
+  }
+
+  iterator find(const key_type &key) { return tree().find(key); }
+
+  iterator lower_bound(const key_type &key) { return tree().lower_bound(key); }
+
+  template <typename F>
+  std::size_t scan(const key_type &lo, const key_type &hi, F &&f) {
+    return tree().scan(lo, hi, std::forward<F>(f));
+  }
+
+  std::size_t size() const { return tree().size(); }
+
+  bool empty() const { return tree().empty(); }
+
+  iterator begin() { return tree().begin(); }
+  iterator end() { return _tree.end(); }
+
+  // Waits for every change made so far to be on disk, in the log.
+  void commit() {
+    check_usable();
+    _log.commit();
+  }
+
+  // Writes every changed page to the tree file and empties the log.
+  void checkpoint();
+
+  // Changes not committed yet.
+  std::size_t pending() const { return _log.pending(); }
+
+private:
+  enum class op : std::uint8_t { insert, erase };
+
+  // A log record: a sequence number, which the tree file's header keeps the
+  // last checkpointed one of, then the operation and its key and value.
+  static constexpr std::size_t record_bytes =
+      sizeof(std::uint64_t) + 1 + sizeof(K) + sizeof(V);
+
+  // Writes the pages of a complete journal at `path` to the tree file.
+  // Returns `path`, so that it can run before the tree opens the file.
+  static const std::string &apply_journal(detail::write_ahead_log &journal,
+                                          const std::string &path);
+
+  // Replays the log records after the last checkpoint.
+  void replay();
+
+  // Appends a record for the change and returns its sequence number.
+  std::uint64_t log(op o, const key_type &key, const value_type *value);
+
+  std::size_t apply(op o, const key_type &key, const value_type &value);
+
+  // Whether the pool is too full for the next change to be sure of room:
+  // half of it dirty, or fewer clean frames than an insert that splits up
+  // to the root needs, since dirty pages cannot be evicted.
+  bool pool_full();
+
+  // Checkpoints once the pool is full or the log is long enough.
+  void maybe_checkpoint();
+
+  // Writes the pages as a checkpoint does, but keeps the log, which may
+  // still have changes the pages do not have in full.
+  void spill();
+
+  // The part of checkpoint that writes the pages, leaving the log alone.
+  void write_pages();
+
+  // Drops the changes since the last checkpoint, after a change threw.
+  void fail();
+
+  // Throws if a change failed.
+  void check_usable() const;
+
+  tree_type &tree() {
+    check_usable();
+    return _tree;
+  }
+  const tree_type &tree() const {
+    check_usable();
+    return _tree;
+  }
+
+  detail::buffer_pool &pool() { return _tree._pool; }
+
+  durability_options _options;
+  detail::write_ahead_log _journal;
+  tree_type _tree;
+  detail::write_ahead_log _log;
+  std::uint64_t _next_lsn;
+  // The last change applied in full, which is what a checkpoint covers.
+  std::uint64_t _applied_lsn;
+  bool _failed = false;
+};
+
+template <typename K, typename V, std::size_t P, typename C>
+constexpr std::size_t durable_btree<K, V, P, C>::min_cached_pages;
+
+template <typename K, typename V, std::size_t P, typename C>
+constexpr std::size_t durable_btree<K, V, P, C>::record_bytes;
+
+template <typename K, typename V, std::size_t P, typename C>
+durable_btree<K, V, P, C>::durable_btree(const std::string &path,
+                                         std::size_t cache_bytes,
+                                         const durability_options &options,
+                                         const C &comp)
+    : _options(options),
+      _journal(path + ".journal", std::numeric_limits<std::size_t>::max()),
+      _tree(apply_journal(_journal, path),
+            std::max(cache_bytes, min_cached_pages * P), comp),
+      _log(path + ".wal", options.group_commit, options.group_commit_delay) {
+  // From here on the tree file only changes at checkpoints.
+  pool().set_write_back(false);
+  _applied_lsn = _tree.meta()->checkpoint_lsn;
+  _next_lsn = _applied_lsn + 1;
+  try {
+    replay();
+    // Puts the replayed changes (or a new tree) in the file, so that a
+    // crash from here on finds the file and the log as this left them.
+    checkpoint();
+  } catch (...) {
+    // Keep paged_btree from writing half replayed pages in place as it
+    // goes. The file keeps what it had, plus only whole checkpoints of
+    // changes replayed in full, so the next open finds what this one did.
+    pool().discard();
+    throw;
+  }
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+durable_btree<K, V, P, C>::~durable_btree() {
+  try {
+    if (_failed) {
+      _log.commit();
+    } else {
+      checkpoint();
+    }
+  } catch (...) {
+    // Keep paged_btree from writing pages in place without a journal. The
+    // log has the changes, if it could be synced.
+    pool().discard();
+  }
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+const std::string &
+durable_btree<K, V, P, C>::apply_journal(detail::write_ahead_log &journal,
+                                         const std::string &path) {
+  // Pages, each after its page number, then an empty record once they are
+  // all there.
+  std::vector<std::vector<char>> pages;
+  bool complete = false;
+  journal.replay([&](const void *data, std::size_t bytes) {
+    auto p = static_cast<const char *>(data);
+    complete = bytes == 0;
+    if (bytes == sizeof(detail::page_id) + P) {
+      pages.emplace_back(p, p + bytes);
+    }
+  });
+  if (complete) {
+    detail::page_file file(path, P);
+    for (auto &page : pages) {
+      detail::page_id id;
+      std::memcpy(&id, page.data(), sizeof(id));
+      file.write(id, page.data() + sizeof(id));
+    }
+    file.sync();
+  }
+  // Either the pages are in the file now or the checkpoint never got to
+  // writing them, and the log still has everything since the one before.
+  journal.reset();
+  return path;
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+void durable_btree<K, V, P, C>::replay() {
+  auto checkpointed = _tree.meta()->checkpoint_lsn;
+  _log.replay([&](const void *data, std::size_t bytes) {
+    if (bytes != record_bytes) {
+      return;
+    }
+    auto p = static_cast<const char *>(data);
+    std::uint64_t lsn;
+    std::memcpy(&lsn, p, sizeof(lsn));
+    // Already in the file: the crash came after the checkpoint wrote its
+    // pages, before it emptied the log.
+    if (lsn <= checkpointed) {
+      return;
+    }
+    key_type key;
+    value_type value;
+    std::memcpy(&key, p + sizeof(lsn) + 1, sizeof(key));
+    std::memcpy(&value, p + sizeof(lsn) + 1 + sizeof(key), sizeof(value));
+    apply(static_cast<op>(p[sizeof(lsn)]), key, value);
+    _applied_lsn = lsn;
+    _next_lsn = lsn + 1;
+    // The pool may fill up with the replayed changes. The log has to stay
+    // until they are all in the file, so only the pages are written.
+    if (pool_full()) {
+      spill();
+    }
+  });
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+std::uint64_t durable_btree<K, V, P, C>::log(op o, const key_type &key,
+                                             const value_type *value) {
+  char record[record_bytes] = {};
+  auto lsn = _next_lsn++;
+  std::memcpy(record, &lsn, sizeof(lsn));
+  record[sizeof(lsn)] = static_cast<char>(o);
+  std::memcpy(record + sizeof(lsn) + 1, &key, sizeof(key));
+  if (value) {
+    std::memcpy(record + sizeof(lsn) + 1 + sizeof(key), value, sizeof(V));
+  }
+  _log.append(record, record_bytes);
+  return lsn;
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+std::size_t durable_btree<K, V, P, C>::apply(op o, const key_type &key,
+                                             const value_type &value) {
+  if (o == op::insert) {
+    _tree.insert(key, value);
+    return 1;
+  }
+  // A long run of duplicates can dirty more leaves than the pool holds.
+  return _tree.erase(key, [&] {
+    if (pool_full()) {
+      spill();
+    }
+  });
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+void durable_btree<K, V, P, C>::insert(const key_type &key,
+                                       const value_type &value) {
+  check_usable();
+  try {
+    auto lsn = log(op::insert, key, &value);
+    apply(op::insert, key, value);
+    _applied_lsn = lsn;
+    maybe_checkpoint();
+  } catch (...) {
+    fail();
+    throw;
+  }
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+std::size_t durable_btree<K, V, P, C>::erase(const key_type &key) {
+  check_usable();
+  try {
+    auto lsn = log(op::erase, key, nullptr);
+    auto count = apply(op::erase, key, value_type());
+    _applied_lsn = lsn;
+    maybe_checkpoint();
+    return count;
+  } catch (...) {
+    fail();
+    throw;
+  }
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+bool durable_btree<K, V, P, C>::pool_full() {
+  auto reserve = std::max(pool().frames() / 2, 2 * _tree._height + 4);
+  return pool().frames() - pool().dirty_pages() < reserve;
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+void durable_btree<K, V, P, C>::maybe_checkpoint() {
+  if (pool_full() || _log.bytes() >= _options.checkpoint_log_bytes) {
+    checkpoint();
+  }
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+void durable_btree<K, V, P, C>::checkpoint() {
+  check_usable();
+  // The pages must not get to disk ahead of the log records for them.
+  _log.commit();
+  write_pages();
+  _log.reset();
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+void durable_btree<K, V, P, C>::spill() {
+  _log.commit();
+  write_pages();
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+void durable_btree<K, V, P, C>::write_pages() {
+  if (pool().dirty_pages() == 0) {
+    return;
+  }
+  _tree.meta()->checkpoint_lsn = _applied_lsn;
+  _tree._meta.mark_dirty();
+
+  std::vector<char> record(sizeof(detail::page_id) + P);
+  pool().for_each_dirty([&](detail::page_id id, const void *data) {
+    std::memcpy(record.data(), &id, sizeof(id));
+    std::memcpy(record.data() + sizeof(id), data, P);
+    _journal.append(record.data(), record.size());
+  });
+  _journal.append(nullptr, 0);
+  _journal.commit();
+
+  pool().flush();
+  _tree._file.sync();
+  _journal.reset();
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+void durable_btree<K, V, P, C>::fail() {
+  _failed = true;
+  pool().discard();
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+void durable_btree<K, V, P, C>::check_usable() const {
+  if (_failed) {
+    throw std::runtime_error(
+        "durable_btree: a change failed; open the tree again to recover");
+  }
+}
+
+} // namespace amidvidy
@@ -1,95 +1,211 @@
 #pragma once
 
 #include <tuple>
-#include <array>
 #include <memory>
+#include <new>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+#include "key_search.hpp"
 
 #ifndef AMIDVIDY_IN_BTREE_HPP
 #error "Do not include this file directly, include btree.hpp instead."
 #endif
 
 namespace amidvidy {
+namespace detail {
+
+// Calls a scan callback, treating callbacks that return nothing as asking
+// to continue.
+template <typename F, typename... Args>
+auto visit(F &f, Args &&... args)
+    -> std::enable_if_t<std::is_void<decltype(f(args...))>::value, bool> {
+  f(std::forward<Args>(args)...);
+  return true;
+}
+
+template <typename F, typename... Args>
+auto visit(F &f, Args &&... args)
+    -> std::enable_if_t<!std::is_void<decltype(f(args...))>::value, bool> {
+  return static_cast<bool>(f(std::forward<Args>(args)...));
+}
+
+// Moves [first, last) to `dest` by assignment, front to back or back to
+// front, whichever is safe when the ranges overlap.
+template <typename T> void move_within(T *first, T *last, T *dest) {
+  if (dest < first) {
+    std::move(first, last, dest);
+  } else if (dest > first) {
+    std::move_backward(first, last, dest + (last - first));
+  }
+}
+
+} // namespace detail
 
-// TODO, move a lot of common functionality between leaf and internal nodes up
-// here.
-template <typename K, typename V, std::size_t BucketSize, typename Compare>
-class btree<K, V, BucketSize, Compare>::node {
+// Nodes are not polymorphic: every node carries a tag saying whether it is a
+// leaf or an internal node, and the tree dispatches on that tag. This keeps
+// descents free of indirect calls so the per-level search can be inlined.
+template <typename K, typename V, std::size_t BucketSize, typename Compare,
+          typename Policy>
+class btree<K, V, BucketSize, Compare, Policy>::node {
 public:
-  virtual ~node() = default;
+  enum class kind : std::uint8_t { leaf, internal };
+
+  bool is_leaf() const { return _kind == kind::leaf; }
+
+  bool full() const;
+
+  // The entries under this node. Internal nodes only keep track of that with
+  // order statistics.
+  std::size_t entries();
+
+  // The aggregate of the entries under this node, worked out from the
+  // entries of a leaf or the results an internal node keeps.
+  aggregate_type aggregate();
 
-  virtual iterator search(key_type key) = 0;
+  leaf_node *as_leaf() { return static_cast<leaf_node *>(this); }
 
-  virtual iterator insert(key_type key, value_type value) = 0;
+  internal_node *as_internal() { return static_cast<internal_node *>(this); }
 
-  virtual iterator begin() = 0;
+  iterator begin();
 
-  virtual std::ostream &print(std::ostream &os) = 0;
+  std::ostream &print(std::ostream &os);
 
-  virtual void set_parent(internal_node *parent) = 0;
+  internal_node *parent() { return _parent; }
 
-  virtual key_type lowest_key() = 0;
+  void set_parent(internal_node *parent) { _parent = parent; }
+
+  const Compare &compare() const { return _owner->compare(); }
+
+protected:
+  node(kind k, btree *owner) : _kind(k), _owner(owner) {}
+
+  // Only node_deleter destroys nodes, and it does so through the most derived
+  // type.
+  ~node() = default;
+
+  friend class btree;
+
+  // Only does anything in concurrent mode.
+  lock_type _lock;
+  kind _kind;
+  internal_node *_parent = nullptr;
+  btree *_owner;
 };
 
-template <typename K, typename V, std::size_t BucketSize, typename Compare>
-class btree<K, V, BucketSize, Compare>::leaf_node : public btree::node {
+// Leaves keep keys and values in separate arrays so that searching a leaf
+// only touches keys; a value is read only once its slot has been found.
+template <typename K, typename V, std::size_t BucketSize, typename Compare,
+          typename Policy>
+class btree<K, V, BucketSize, Compare, Policy>::leaf_node : public btree::node {
+  friend class btree;
+  friend class node;
+
 public:
-  leaf_node(btree *owner) : _owner(owner) {}
+  leaf_node(btree *owner) : node(node::kind::leaf, owner) {}
 
-  iterator insert(key_type key, value_type value) final {
-    // Does this entry fit? otherwise we need to split.
-    if (_size == BucketSize) {
-      leaf_node *node_for_key = split_for_insert(key);
-      // Could end inserting here or the new node, depending on where the key
-      // compared to our split point.
-      return node_for_key->insert(key, value);
+  ~leaf_node() {
+    _keys.destroy(0, _size);
+    _values.destroy(0, _size);
+  }
+
+  // Adds an entry for the key with a value constructed from `args`.
+  //
+  // The key and value are built before any entry moves, as
+  // std::vector::emplace does, since either may refer to an entry of the
+  // tree, which a split or open_slot would move out from under it.
+  template <typename KArg, typename... Args>
+  iterator emplace(KArg &&key, Args &&... args) {
+    key_type k(std::forward<KArg>(key));
+    value_type v(std::forward<Args>(args)...);
+    return emplace_built(k, v);
+  }
+
+  // Removes the entry at the index and returns an iterator to the entry that
+  // followed it.
+  iterator erase(std::size_t index) {
+    _keys.destroy(index);
+    _values.destroy(index);
+    close_slot(index);
+    --_size;
+    this->_owner->update_summaries(this, -1);
+    return rebalance(index);
+  }
+
+  // An entry with the key, or end(). Besides this leaf, only the last entry
+  // of the previous one can have it, when a run of equal keys ends there.
+  iterator find_equal(const key_type &key) {
+    auto &comp = this->compare();
+    auto index = lower_bound(key);
+    if (index < _size && !comp(key, _keys[index])) {
+      return iterator(this, index);
     }
-    // Use upper bound so items with same key are kept in insertion order.
-    auto storage_iter = std::upper_bound(
-        storage_begin(), storage_end(), item_type(key, value), item_comparator);
-    if (storage_iter != storage_end()) {
-      // We already are in range. Move the matching elements back to make room.
-      auto new_end = storage_end() + 1;
-      std::move_backward(storage_iter, storage_end(), new_end);
-      *storage_iter = item_type(key, value);
-    } else {
-      *storage_end() = item_type(key, value);
-      storage_iter = storage_end();
+    if (index == 0 && _prev && !comp(_prev->_keys[_prev->_size - 1], key)) {
+      return iterator(_prev, _prev->_size - 1);
     }
-    ++_size;
-    return iterator(this, storage_iter);
+    return this->_owner->end();
   }
 
-  iterator search(key_type key) final {
-    auto storage_iter = std::lower_bound(storage_begin(), storage_end(),
-                                         item_type(key, -1), item_comparator);
+  // Starts loading the lines a search of this leaf begins with.
+  void prefetch() const {
+    detail::prefetch(this);
+    detail::prefetch(_keys.data() + leaf_capacity / 4);
+    detail::prefetch(_keys.data() + leaf_capacity / 2);
+  }
 
-    if (storage_iter != storage_end()) {
-      return iterator(this, storage_iter);
+  // Adds the entries of a batch: plan[i] holds an iterator to the i-th new
+  // entry, and the index of the entry already here that it goes before.
+  // Working from the back, every existing entry is moved once, straight to
+  // its final slot. If constructing an entry throws, the ones not added yet
+  // are left out.
+  template <typename It>
+  void merge(const std::vector<std::pair<It, std::size_t>> &plan) {
+    auto end = _size;
+    auto total = _size + plan.size();
+    for (auto i = plan.size(); i-- > 0;) {
+      auto pos = plan[i].second;
+      auto slot = pos + i;
+      take(this, pos, end - pos, slot + 1);
+      end = pos;
+      try {
+        _keys.construct(slot, std::get<0>(*plan[i].first));
+        try {
+          _values.construct(slot, std::get<1>(*plan[i].first));
+        } catch (...) {
+          _keys.destroy(slot);
+          throw;
+        }
+      } catch (...) {
+        take(this, slot + 1, total - slot - 1, pos);
+        _size = total - i - 1;
+        this->_owner->update_summaries(
+            this, static_cast<std::ptrdiff_t>(plan.size() - i - 1));
+        throw;
+      }
     }
-    return iterator();
+    _size = total;
+    this->_owner->update_summaries(this,
+                                static_cast<std::ptrdiff_t>(plan.size()));
   }
 
-  iterator begin() final { return iterator(this, storage_begin()); }
+  // Only the root leaf is ever empty.
+  iterator begin() { return iterator(this, 0); }
 
   leaf_node *next() { return _next; }
 
   leaf_node *prev() { return _prev; }
 
-  std::ostream &print(std::ostream &os) final {
+  std::ostream &print(std::ostream &os) {
     os << "leaf_node:" << this << std::endl;
-    auto iter = storage_begin();
-    while (iter != storage_end()) {
+    for (std::size_t i = 0; i < _size; ++i) {
       os << "\t"
-         << "(" << std::get<0>(*iter) << ", " << std::get<1>(*iter) << ")"
-         << std::endl;
-      ++iter;
+         << "(" << _keys[i] << ", " << _values[i] << ")" << std::endl;
     }
     return os;
   }
 
 private:
-  internal_node *_parent = nullptr;
-
   friend class iterator;
 
   leaf_node *_next = nullptr;
@@ -97,103 +213,258 @@ private:
 
   std::size_t _size = 0;
 
-  btree *_owner;
+  // Only the first _size slots hold entries.
+  detail::slot_array<key_type, leaf_capacity> _keys;
+  detail::slot_array<value_type, leaf_capacity> _values;
 
-  std::array<std::tuple<key_type, value_type>, BucketSize> _storage;
+  key_type *key_iter(std::size_t index) { return _keys.data() + index; }
 
-  using storage_iter_type = decltype(std::begin(_storage));
+  value_type *value_iter(std::size_t index) { return _values.data() + index; }
 
-  void set_parent(internal_node *parent) final { _parent = parent; }
+  // emplace, with the key and value already out of the tree. Moves them in.
+  iterator emplace_built(key_type &key, value_type &value) {
+    // Does this entry fit? otherwise we need to split.
+    if (_size == leaf_capacity) {
+      leaf_node *node_for_key = split_for_insert(key);
+      // Could end inserting here or the new node, depending on where the key
+      // compared to our split point.
+      return node_for_key->emplace_built(key, value);
+    }
+    // Use upper bound so items with same key are kept in insertion order.
+    auto index = upper_bound(key);
+    open_slot(index);
+    try {
+      _values.construct(index, std::move(value));
+      try {
+        _keys.construct(index, std::move(key));
+      } catch (...) {
+        _values.destroy(index);
+        throw;
+      }
+    } catch (...) {
+      close_slot(index);
+      throw;
+    }
+    ++_size;
+    this->_owner->update_summaries(this, 1);
+    return iterator(this, index);
+  }
+
+  // Shifts the entries from the index on one slot right, leaving the slot at
+  // the index unconstructed. _size is left to the caller.
+  void open_slot(std::size_t index) {
+    detail::relocate(key_iter(index), key_iter(_size), key_iter(index + 1));
+    detail::relocate(value_iter(index), value_iter(_size),
+                     value_iter(index + 1));
+  }
+
+  // Undoes open_slot, or fills the hole an already destroyed entry left at
+  // the index.
+  void close_slot(std::size_t index) {
+    detail::relocate(key_iter(index + 1), key_iter(_size), key_iter(index));
+    detail::relocate(value_iter(index + 1), value_iter(_size),
+                     value_iter(index));
+  }
+
+  // Moves `count` entries starting at `from` in `source` to the unconstructed
+  // slots starting at `to` in ours.
+  void take(leaf_node *source, std::size_t from, std::size_t count,
+            std::size_t to) {
+    detail::relocate(source->key_iter(from), source->key_iter(from + count),
+                     key_iter(to));
+    detail::relocate(source->value_iter(from),
+                     source->value_iter(from + count), value_iter(to));
+  }
+
+  key_type lowest_key() { return _keys[0]; }
+
+  // The iterator for a slot, where one past our last entry is the first entry
+  // of the next leaf, or end() if there is none.
+  static iterator iterator_at(leaf_node *leaf, std::size_t index) {
+    if (index < leaf->_size || !leaf->_next) {
+      return iterator(leaf, index);
+    }
+    return leaf->_next->begin();
+  }
 
-  auto storage_begin() { return std::begin(_storage); }
+  void unlink() {
+    if (this->_owner->_rightmost == this) {
+      this->_owner->_rightmost = _prev;
+    }
+    if (_prev) {
+      _prev->_next = _next;
+    }
+    if (_next) {
+      _next->_prev = _prev;
+    }
+  }
+
+  // Moves all of our right sibling's entries to the end of ours and takes it
+  // out of the leaf chain. Our parent still has to drop it.
+  void absorb(leaf_node *right) {
+    take(right, 0, right->_size, _size);
+    _size += right->_size;
+    right->_size = 0;
+    right->unlink();
+  }
+
+  // Brings us back up to the minimum fill after an erase, by borrowing an
+  // entry from a sibling or by merging with one. `index` is the slot of the
+  // entry that followed the erased one; the returned iterator points at that
+  // entry wherever it ends up.
+  iterator rebalance(std::size_t index) {
+    auto parent = this->_parent;
+    auto min_size = this->_owner->min_entries(leaf_capacity);
+    if (!parent || _size >= min_size) {
+      return iterator_at(this, index);
+    }
+
+    auto position = parent->index_of(this);
+    auto left =
+        position > 0 ? parent->child(position - 1)->as_leaf() : nullptr;
+    auto right = position + 1 < parent->_size
+                     ? parent->child(position + 1)->as_leaf()
+                     : nullptr;
+
+    if (left && left->_size > min_size) {
+      // Take the largest entry of our left sibling.
+      open_slot(0);
+      --left->_size;
+      take(left, left->_size, 1, 0);
+      ++_size;
+      parent->set_key(position, _keys[0]);
+      parent->resummarize(position - 1);
+      parent->resummarize(position);
+      return iterator_at(this, index + 1);
+    }
+    if (right && right->_size > min_size) {
+      // Take the smallest entry of our right sibling.
+      take(right, 0, 1, _size);
+      ++_size;
+      right->close_slot(0);
+      --right->_size;
+      parent->set_key(position + 1, right->_keys[0]);
+      parent->resummarize(position);
+      parent->resummarize(position + 1);
+      return iterator_at(this, index);
+    }
+    if (left) {
+      auto merged_index = left->_size + index;
+      left->absorb(this);
+      parent->resummarize(position - 1);
+      // This destroys us.
+      parent->remove_child(position);
+      return iterator_at(left, merged_index);
+    }
+    if (right) {
+      absorb(right);
+      parent->resummarize(position);
+      parent->remove_child(position + 1);
+      return iterator_at(this, index);
+    }
+    if (_size == 0) {
+      // With a low minimum fill we can be an only child, in which case there
+      // is no one to merge with and we just go away once empty.
+      auto next = _next;
+      unlink();
+      parent->remove_child(position);
+      return next ? next->begin() : this->_owner->end();
+    }
+    return iterator_at(this, index);
+  }
 
-  auto storage_end() { return storage_begin() + _size; }
+  using key_search = detail::key_search<key_type, Compare, sizeof(key_type)>;
 
-  key_type lowest_key() final { return std::get<0>(*storage_begin()); }
+  template <typename Q> std::size_t lower_bound(const Q &key) {
+    return key_search::lower_bound(_keys.data(), _size, key,
+                                   this->compare());
+  }
 
-  static bool item_comparator(const item_type &rhs, const item_type &lhs) {
-    return std::get<0>(rhs) < std::get<0>(lhs);
+  template <typename Q> std::size_t upper_bound(const Q &key) {
+    return key_search::upper_bound(_keys.data(), _size, key,
+                                   this->compare());
   }
 
   // Returns the node to insert the key in to.
-  leaf_node *split_for_insert(key_type to_insert) {
+  leaf_node *split_for_insert(const key_type &to_insert) {
     // time to split. allocate a new node.
-    auto new_node = std::make_unique<leaf_node>(_owner);
-    auto new_node_unowned = new_node.get();
-    auto split_point = storage_begin() + (_size / 2);
-    auto split_key = std::get<0>(*split_point);
+    auto new_node = node_ptr(this->_owner->new_leaf());
+    auto new_node_unowned = new_node->as_leaf();
+    // Appending: only the last entry moves over, to go with the new one.
+    bool append = Policy::append_split && !_next &&
+                  !this->compare()(to_insert, _keys[_size - 1]);
+    auto split_point = btree::split_point(_size, append);
 
     auto old_next = _next;
-    _next = new_node.get();
-    new_node->_next = old_next;
-    new_node->_prev = this;
-
-    // Copy the second half of our entries to the new node.
-    std::move(split_point, storage_end(), new_node->storage_begin());
+    _next = new_node_unowned;
+    new_node_unowned->_next = old_next;
+    new_node_unowned->_prev = this;
+    if (old_next) {
+      old_next->_prev = new_node_unowned;
+    } else {
+      this->_owner->_rightmost = new_node_unowned;
+    }
 
-    auto old_size = _size;
-    _size = split_point - storage_begin();
-    new_node->_size += old_size - _size; // handle odd branching factors...
+    // Move the entries past the split point to the new node.
+    new_node_unowned->take(this, split_point, _size - split_point, 0);
+    new_node_unowned->_size = _size - split_point;
+    _size = split_point;
 
-    // If we are not the root.
-    if (_parent) {
-      auto new_node_lowest_key = new_node->lowest_key();
-      _parent->insert_node(std::move(new_node_lowest_key), std::move(new_node));
+    auto separator = new_node_unowned->lowest_key();
+    if (this->_parent) {
+      this->_parent->insert_node(this, std::move(separator),
+                                 std::move(new_node), append);
     } else {
-      // We are the root.
-      // take ownership of ourself.
-      auto this_node = std::move(_owner->_root);
-      // Make a new internal node for the root.
-      auto new_root = std::make_unique<internal_node>(_owner);
-      // insert ourself.
-      auto this_node_lowest_key = lowest_key();
-      new_root->insert_node(std::move(this_node_lowest_key),
-                            std::move(this_node));
-      // make the new root our parent (as well as the new node's).
-      // insert the new node.
-      auto new_node_lowest_key = new_node->lowest_key();
-      new_root->insert_node(new_node_lowest_key, std::move(new_node));
-      // make the new node the root.
-      _owner->_root = std::move(new_root);
-    }
-
-    if (to_insert >= split_key) {
+      this->_owner->grow_root(std::move(separator), std::move(new_node));
+    }
+
+    if (!this->compare()(to_insert, new_node_unowned->_keys[0])) {
       return new_node_unowned;
     }
     return this;
   }
 };
 
-template <typename K, typename V, std::size_t BucketSize, typename Compare>
-class btree<K, V, BucketSize, Compare>::iterator
-    : public std::iterator<std::bidirectional_iterator_tag, item_type> {
+// Since keys and values are stored apart there is no item to hand out a
+// reference to, so dereferencing yields a tuple of references into the leaf.
+//
+// An iterator is a leaf and a slot in it. end() is the slot one past the last
+// entry of the last leaf, so that it can be decremented like any other.
+template <typename K, typename V, std::size_t BucketSize, typename Compare,
+          typename Policy>
+class btree<K, V, BucketSize, Compare, Policy>::iterator
+    : public std::iterator<std::bidirectional_iterator_tag, item_type,
+                           std::ptrdiff_t, void, reference> {
 public:
+  class pointer {
+  public:
+    reference *operator->() { return &_ref; }
+
+  private:
+    friend class iterator;
+
+    pointer(reference ref) : _ref(ref) {}
+
+    reference _ref;
+  };
+
   iterator() = default;
 
-  iterator(leaf_node *node,
-           typename btree<K, V, BucketSize,
-                          Compare>::leaf_node::storage_iter_type storage_iter)
-      : _node(node), _storage_iter(storage_iter) {}
+  iterator(leaf_node *node, std::size_t index) : _node(node), _index(index) {}
 
-  item_type &operator*() {
+  reference operator*() const {
     check_valid();
-    return *_storage_iter;
+    return reference(_node->_keys[_index], _node->_values[_index]);
   }
 
-  item_type *operator->() {
-    check_valid();
-    return *_storage_iter;
-  }
+  pointer operator->() const { return pointer(operator*()); }
 
-  iterator operator++() {
+  iterator &operator++() {
     check_valid();
-    ++_storage_iter;
-    if (_storage_iter == _node->storage_end()) {
-      if (auto next_node = _node->next()) {
-        *this = next_node->begin();
-      } else {
-        *this = iterator();
-      }
+    ++_index;
+    if (_index == _node->_size && _node->_next) {
+      _node = _node->_next;
+      _index = 0;
     }
     return *this;
   }
@@ -204,9 +475,21 @@ public:
     return prev;
   }
 
-  iterator operator--();
+  iterator &operator--() {
+    check_decrement();
+    if (_index == 0) {
+      _node = _node->_prev;
+      _index = _node->_size;
+    }
+    --_index;
+    return *this;
+  }
 
-  iterator operator--(int);
+  iterator operator--(int) {
+    auto next = *this;
+    operator--();
+    return next;
+  }
 
   friend bool operator==(const iterator &rhs, const iterator &lhs) {
     return rhs.tie() == lhs.tie();
@@ -217,177 +500,1414 @@ public:
   }
 
 private:
-  void check_valid() {
-    if (!_node || _storage_iter < _node->storage_begin() ||
-        _storage_iter >= _node->storage_end()) {
-      throw std::exception();
+  friend class btree;
+  friend class const_iterator;
+
+  // Both compile away unless Policy::checked_iterators is set.
+  void check_valid() const {
+    if (Policy::checked_iterators && (!_node || _index >= _node->_size)) {
+      throw std::out_of_range("btree iterator not dereferenceable");
+    }
+  }
+
+  void check_decrement() const {
+    if (Policy::checked_iterators &&
+        (!_node || (_index == 0 && !_node->_prev))) {
+      throw std::out_of_range("btree iterator decremented past begin");
     }
   }
 
-  auto tie() const { return std::tie(_node, _storage_iter); }
+  auto tie() const { return std::tie(_node, _index); }
 
   leaf_node *_node = nullptr;
-  typename leaf_node::storage_iter_type _storage_iter = nullptr;
+  std::size_t _index = 0;
 };
 
-template <typename K, typename V, std::size_t BucketSize, typename Compare>
-class btree<K, V, BucketSize, Compare>::internal_node : public node {
+// The same walk as iterator, handing out const references. An iterator
+// converts to one.
+template <typename K, typename V, std::size_t BucketSize, typename Compare,
+          typename Policy>
+class btree<K, V, BucketSize, Compare, Policy>::const_iterator
+    : public std::iterator<std::bidirectional_iterator_tag, item_type,
+                           std::ptrdiff_t, void, const_reference> {
+public:
+  class pointer {
+  public:
+    const const_reference *operator->() const { return &_ref; }
+
+  private:
+    friend class const_iterator;
+
+    pointer(const_reference ref) : _ref(ref) {}
+
+    const_reference _ref;
+  };
+
+  const_iterator() = default;
+
+  const_iterator(iterator iter) : _iter(iter) {}
+
+  const_reference operator*() const { return *_iter; }
+
+  pointer operator->() const { return pointer(operator*()); }
+
+  const_iterator &operator++() {
+    ++_iter;
+    return *this;
+  }
+
+  const_iterator operator++(int) { return _iter++; }
+
+  const_iterator &operator--() {
+    --_iter;
+    return *this;
+  }
+
+  const_iterator operator--(int) { return _iter--; }
+
+  friend bool operator==(const const_iterator &rhs,
+                         const const_iterator &lhs) {
+    return rhs._iter == lhs._iter;
+  }
+
+  friend bool operator!=(const const_iterator &rhs,
+                         const const_iterator &lhs) {
+    return !(rhs == lhs);
+  }
+
+private:
+  iterator _iter;
+};
+
+template <typename K, typename V, std::size_t BucketSize, typename Compare,
+          typename Policy>
+class btree<K, V, BucketSize, Compare, Policy>::internal_node : public node {
+  friend class btree;
+  friend class node;
   friend class leaf_node;
 
 public:
-  internal_node(btree *owner) : _owner(owner) {}
+  internal_node(btree *owner) : node(node::kind::internal, owner) {}
 
-  iterator insert(key_type key, value_type value) final {
-    auto storage_iter = std::upper_bound(storage_begin(), storage_end(),
-                                         internal_item_type(key, nullptr),
-                                         internal_item_comparator);
-    // Since we currently point to the first key that is greater than us, we
-    // want
-    // to
-    // go back one (so we're pointing at the last key less than or equal to us).
-    --storage_iter;
-    return std::get<1>(*storage_iter)->insert(key, value);
+  ~internal_node() {
+    _keys.destroy(0, _size ? _size - 1 : 0);
+    _children.destroy(0, _size);
   }
 
-  iterator search(key_type key) final {
-    auto storage_iter = std::lower_bound(storage_begin(), storage_end(),
-                                         internal_item_type(key, nullptr),
-                                         internal_item_comparator);
-    if (storage_iter == storage_end()) {
-      return iterator();
-    }
-    return std::get<1>(*storage_iter)->search(key);
+  // Returns the child whose subtree the key belongs in. This is the whole
+  // per-level step of a descent, so keep it small enough to inline.
+  template <typename Q> node *child_for(const Q &key) {
+    auto index =
+        key_search::upper_bound(_keys.data(), _size - 1, key, this->compare());
+    return _children[index].get();
   }
 
-  iterator begin() final { return std::get<1>(*storage_begin())->begin(); }
+  iterator begin() { return _children[0]->begin(); }
+
+  // Starts loading the lines a search of this node begins with.
+  void prefetch() const {
+    detail::prefetch(this);
+    detail::prefetch(_keys.data() + internal_capacity / 4);
+    detail::prefetch(_keys.data() + internal_capacity / 2);
+  }
 
-  std::ostream &print(std::ostream &os) final {
+  std::ostream &print(std::ostream &os) {
     os << "internal_node:" << this << std::endl;
-    auto storage_iter = storage_begin();
-    while (storage_iter != storage_end()) {
+    for (std::size_t i = 0; i + 1 < _size; ++i) {
       os << "\t"
-         << "key: " << std::get<0>(*storage_iter) << std::endl;
-      ++storage_iter;
+         << "key: " << _keys[i] << std::endl;
     }
-    storage_iter = storage_begin();
-    while (storage_iter != storage_end()) {
-      std::get<1>(*storage_iter)->print(os);
-      ++storage_iter;
+    for (std::size_t i = 0; i < _size; ++i) {
+      _children[i]->print(os);
     }
     return os;
   }
 
 private:
-  void insert_node(key_type key, std::unique_ptr<node> node) {
-    if (_size == BucketSize) {
-      auto node_for_key = split_for_insert(key);
-      return node_for_key->insert_node(key, std::move(node));
+  // Inserts the node as the sibling immediately after `left`, with `key`
+  // separating the two. Placing it by position rather than by key keeps runs
+  // of children with equal separators (duplicate keys) in order. `append`
+  // says the node was split off the end of the last node below us.
+  void insert_node(node *left, key_type key, node_ptr node,
+                   bool append = false) {
+    if (_size == internal_capacity + 1) {
+      split_for_insert(append && left == child(_size - 1));
+      // After the split `left` may live in either half.
+      return left->parent()->insert_node(left, key, std::move(node));
     }
 
     node->set_parent(this);
 
-    auto storage_iter = std::upper_bound(storage_begin(), storage_end(),
-                                         internal_item_type(key, nullptr),
-                                         internal_item_comparator);
-
-    auto new_end = storage_end() + 1;
-    std::move_backward(storage_iter, storage_end(), new_end);
-    *storage_iter = internal_item_type(key, std::move(node));
+    auto index = index_of(left) + 1;
+    detail::relocate(key_iter(index - 1), key_iter(_size - 1),
+                     key_iter(index));
+    detail::relocate(child_iter(index), child_iter(_size),
+                     child_iter(index + 1));
+    take_summaries(this, index, _size, index + 1);
+    _keys.construct(index - 1, std::move(key));
+    _children.construct(index, std::move(node));
     ++_size;
+    // The new node's entries all came from `left`.
+    resummarize(index - 1);
+    resummarize(index);
   }
-  void set_parent(internal_node *parent) final { _parent = parent; }
 
-  internal_node *_parent = nullptr;
-  btree *_owner = nullptr;
-  std::size_t _size = 0;
+  node *child(std::size_t index) { return _children[index].get(); }
 
-  using internal_item_type = std::tuple<key_type, std::unique_ptr<node>>;
+  std::size_t index_of(node *child) {
+    std::size_t index = 0;
+    while (_children[index].get() != child) {
+      ++index;
+    }
+    return index;
+  }
 
-  std::array<internal_item_type, BucketSize> _storage;
+  // The separator between child `index - 1` and child `index`.
+  const key_type &key(std::size_t index) { return _keys[index - 1]; }
 
-  static bool internal_item_comparator(const internal_item_type &lhs,
-                                       const internal_item_type &rhs) {
-    return std::get<0>(lhs) < std::get<0>(rhs);
+  void set_key(std::size_t index, const key_type &key) {
+    _keys[index - 1] = key;
   }
 
-  auto storage_begin() { return std::begin(_storage); }
+  // Works out the summaries (see _counts and _aggregates) of the child at
+  // the index again, after entries or children moved between it and a
+  // sibling.
+  void resummarize(std::size_t index) {
+    if (Policy::order_statistics) {
+      _counts[index] = child(index)->entries();
+    }
+    if (aggregating) {
+      _aggregates[index] = child(index)->aggregate();
+    }
+  }
 
-  auto storage_end() { return storage_begin() + _size; }
+  // Moves the summaries of children [first, last) of `source` to ours from
+  // `to` on, along with the children. `source` may be us.
+  void take_summaries(internal_node *source, std::size_t first,
+                      std::size_t last, std::size_t to) {
+    if (Policy::order_statistics) {
+      detail::move_within(source->_counts + first, source->_counts + last,
+                          _counts + to);
+    }
+    if (aggregating) {
+      detail::move_within(source->_aggregates + first,
+                          source->_aggregates + last, _aggregates + to);
+    }
+  }
 
-  key_type lowest_key() final { return std::get<0>(*storage_begin()); }
+  // Destroys the child at the index, along with the separator on its left
+  // (or, for the first child, the one on its right), and rebalances.
+  void remove_child(std::size_t index) {
+    if (_size > 1) {
+      auto key_index = index ? index - 1 : 0;
+      _keys.destroy(key_index);
+      detail::relocate(key_iter(key_index + 1), key_iter(_size - 1),
+                       key_iter(key_index));
+    }
+    _children.destroy(index);
+    detail::relocate(child_iter(index + 1), child_iter(_size),
+                     child_iter(index));
+    take_summaries(this, index + 1, _size, index);
+    --_size;
+    rebalance();
+  }
 
-  internal_node *split_for_insert(key_type to_insert) {
-    // handle splits later.
-    // time to split. allocate a new node.
-    auto new_node = std::make_unique<internal_node>(_owner);
-    auto new_node_unowned = new_node.get();
-    auto split_point = storage_begin() + (_size / 2);
+  // Moves all of our right sibling's children to the end of ours. The key
+  // that separated us comes down from our shared parent.
+  void absorb(internal_node *right, const key_type &separator) {
+    _keys.construct(_size - 1, separator);
+    detail::relocate(right->key_iter(0), right->key_iter(right->_size - 1),
+                     key_iter(_size));
+    for (std::size_t i = 0; i < right->_size; ++i) {
+      right->_children[i]->set_parent(this);
+    }
+    detail::relocate(right->child_iter(0), right->child_iter(right->_size),
+                     child_iter(_size));
+    take_summaries(right, 0, right->_size, _size);
+    _size += right->_size;
+    right->_size = 0;
+  }
 
-    auto split_key = std::get<0>(*split_point);
+  // The internal node counterpart of leaf_node::rebalance. Borrowed children
+  // are rotated through the parent so that every separator stays between the
+  // subtrees it divides.
+  void rebalance() {
+    auto parent = this->_parent;
+    if (!parent) {
+      if (_size == 1) {
+        // This destroys us.
+        this->_owner->collapse_root();
+      }
+      return;
+    }
+    auto min_size = this->_owner->min_entries(internal_capacity);
+    if (_size >= min_size) {
+      return;
+    }
+
+    auto position = parent->index_of(this);
+    if (_size == 0) {
+      // With a low minimum fill we can lose our only child. There is nothing
+      // to keep, so just go away.
+      parent->remove_child(position);
+      return;
+    }
+    auto left =
+        position > 0 ? parent->child(position - 1)->as_internal() : nullptr;
+    auto right = position + 1 < parent->_size
+                     ? parent->child(position + 1)->as_internal()
+                     : nullptr;
+
+    if (left && left->_size > min_size) {
+      detail::relocate(key_iter(0), key_iter(_size - 1), key_iter(1));
+      detail::relocate(child_iter(0), child_iter(_size), child_iter(1));
+      _keys.construct(0, parent->key(position));
+      --left->_size;
+      parent->set_key(position, std::move(left->_keys[left->_size - 1]));
+      left->_keys.destroy(left->_size - 1);
+      detail::relocate(left->child_iter(left->_size),
+                       left->child_iter(left->_size + 1), child_iter(0));
+      _children[0]->set_parent(this);
+      take_summaries(this, 0, _size, 1);
+      take_summaries(left, left->_size, left->_size + 1, 0);
+      ++_size;
+      parent->resummarize(position - 1);
+      parent->resummarize(position);
+      return;
+    }
+    if (right && right->_size > min_size) {
+      _keys.construct(_size - 1, parent->key(position + 1));
+      parent->set_key(position + 1, std::move(right->_keys[0]));
+      right->_keys.destroy(0);
+      detail::relocate(right->child_iter(0), right->child_iter(1),
+                       child_iter(_size));
+      _children[_size]->set_parent(this);
+      take_summaries(right, 0, 1, _size);
+      right->take_summaries(right, 1, right->_size, 0);
+      ++_size;
+      detail::relocate(right->key_iter(1), right->key_iter(right->_size - 1),
+                       right->key_iter(0));
+      detail::relocate(right->child_iter(1), right->child_iter(right->_size),
+                       right->child_iter(0));
+      --right->_size;
+      parent->resummarize(position);
+      parent->resummarize(position + 1);
+      return;
+    }
+    if (left) {
+      left->absorb(this, parent->key(position));
+      parent->resummarize(position - 1);
+      parent->remove_child(position);
+      return;
+    }
+    if (right) {
+      absorb(right, parent->key(position + 1));
+      parent->resummarize(position);
+      parent->remove_child(position + 1);
+    }
+  }
 
-    // Copy the second half of our entries to the new node.
-    std::move(split_point, storage_end(), new_node->storage_begin());
+  key_type *key_iter(std::size_t index) { return _keys.data() + index; }
 
-    auto old_size = _size;
-    _size = split_point - storage_begin();
-    new_node->_size = old_size - _size;
+  node_ptr *child_iter(std::size_t index) { return _children.data() + index; }
+
+  // With `append`, our last child is about to get a new sibling after it,
+  // and only it moves to the new node.
+  void split_for_insert(bool append = false) {
+    // time to split. allocate a new node.
+    auto new_node = node_ptr(this->_owner->new_internal());
+    auto new_node_unowned = new_node->as_internal();
+    auto split_point = btree::split_point(_size, append);
+
+    // Move the children past the split point to the new node. The separator
+    // in front of them moves up to our parent instead.
+    detail::relocate(key_iter(split_point), key_iter(_size - 1),
+                     new_node_unowned->key_iter(0));
+    detail::relocate(child_iter(split_point), child_iter(_size),
+                     new_node_unowned->child_iter(0));
+    new_node_unowned->take_summaries(this, split_point, _size, 0);
+    auto separator = std::move(_keys[split_point - 1]);
+    _keys.destroy(split_point - 1);
+
+    new_node_unowned->_size = _size - split_point;
+    _size = split_point;
 
     // Update parent pointers.
-    for (auto iter = new_node->storage_begin(); iter != new_node->storage_end();
-         ++iter) {
-      std::get<1>(*iter)->set_parent(new_node.get());
+    for (std::size_t i = 0; i < new_node_unowned->_size; ++i) {
+      new_node_unowned->_children[i]->set_parent(new_node_unowned);
     }
 
-    // If we are not the root.
-    if (_parent) {
-      auto new_node_lowest_key = new_node->lowest_key();
-      _parent->insert_node(new_node_lowest_key, std::move(new_node));
+    if (this->_parent) {
+      this->_parent->insert_node(this, std::move(separator),
+                                 std::move(new_node), append);
     } else {
-      // We are the root.
-      // take ownership of ourself.
-      auto this_node = std::move(_owner->_root);
-      // Make a new internal node for the root.
-      auto new_root = std::make_unique<internal_node>(_owner);
-      // insert ourself.
-      new_root->insert_node(lowest_key(), std::move(this_node));
-      // make the new root our parent (as well as the new node's).
-      new_node->_parent = _parent = new_root.get();
-      // insert the new node.
-      auto new_node_lowest_key = new_node->lowest_key();
-      new_root->insert_node(std::move(new_node_lowest_key),
-                            std::move(new_node));
-      // make the new node the root.
-      _owner->_root = std::move(new_root);
-    }
-
-    if (to_insert >= split_key) {
-      return new_node_unowned;
+      this->_owner->grow_root(std::move(separator), std::move(new_node));
     }
-    return this;
   }
+
+  // Number of children; there is one key fewer.
+  std::size_t _size = 0;
+
+  using key_search = detail::key_search<key_type, Compare, sizeof(key_type)>;
+
+  // Keys and children are kept apart so that a descent searches a dense key
+  // array and loads only the one child pointer it follows. _keys[i] separates
+  // _children[i] from _children[i + 1]. The keys start on a cache line of
+  // their own (nodes come from the pool cache line aligned), so the search
+  // touches as few lines as possible. Only the first _size - 1 keys and
+  // _size children are constructed.
+  alignas(64) detail::slot_array<key_type, internal_capacity> _keys;
+  detail::slot_array<node_ptr, internal_capacity + 1> _children;
+
+  // Summaries of the subtree under each child, kept in step with
+  // _children: with order statistics, _counts[i] is the number of entries
+  // under _children[i], and with an aggregate, _aggregates[i] is their
+  // aggregate. Each is a single unused slot when not wanted.
+  std::size_t _counts[Policy::order_statistics ? internal_capacity + 1 : 1];
+  aggregate_type _aggregates[aggregating ? internal_capacity + 1 : 1];
 };
 
-template <typename K, typename V, std::size_t B, typename C>
-btree<K, V, B, C>::btree()
-    : _root(std::make_unique<leaf_node>(this)) {}
+template <typename K, typename V, std::size_t B, typename C, typename P>
+constexpr std::size_t btree<K, V, B, C, P>::node_bytes;
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+constexpr std::size_t btree<K, V, B, C, P>::leaf_capacity;
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+constexpr std::size_t btree<K, V, B, C, P>::internal_capacity;
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+auto btree<K, V, B, C, P>::node::begin() -> iterator {
+  // Walk down the leftmost spine.
+  node *n = this;
+  while (!n->is_leaf()) {
+    n = n->as_internal()->child(0);
+  }
+  return n->as_leaf()->begin();
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+bool btree<K, V, B, C, P>::node::full() const {
+  if (is_leaf()) {
+    return static_cast<const leaf_node *>(this)->_size == leaf_capacity;
+  }
+  return static_cast<const internal_node *>(this)->_size ==
+         internal_capacity + 1;
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+std::size_t btree<K, V, B, C, P>::node::entries() {
+  if (is_leaf()) {
+    return as_leaf()->_size;
+  }
+  auto inner = as_internal();
+  std::size_t total = 0;
+  for (std::size_t i = 0; i < inner->_size; ++i) {
+    total += inner->_counts[i];
+  }
+  return total;
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+auto btree<K, V, B, C, P>::node::aggregate() -> aggregate_type {
+  auto result = aggregate_ops::identity();
+  if (is_leaf()) {
+    auto leaf = as_leaf();
+    for (std::size_t i = 0; i < leaf->_size; ++i) {
+      result = aggregate_ops::combine(
+          result, aggregate_ops::of(leaf->_keys[i], leaf->_values[i]));
+    }
+    return result;
+  }
+  auto inner = as_internal();
+  for (std::size_t i = 0; i < inner->_size; ++i) {
+    result = aggregate_ops::combine(result, inner->_aggregates[i]);
+  }
+  return result;
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+std::ostream &btree<K, V, B, C, P>::node::print(std::ostream &os) {
+  if (is_leaf()) {
+    return as_leaf()->print(os);
+  }
+  return as_internal()->print(os);
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+void btree<K, V, B, C, P>::node_deleter::operator()(node *n) const {
+  auto owner = n->_owner;
+  if (n->is_leaf()) {
+    auto leaf = n->as_leaf();
+    leaf->~leaf_node();
+    owner->_leaf_pool.deallocate(leaf);
+  } else {
+    auto inner = n->as_internal();
+    inner->~internal_node();
+    owner->_internal_pool.deallocate(inner);
+  }
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+auto btree<K, V, B, C, P>::new_leaf() -> leaf_node * {
+  auto p = _leaf_pool.allocate();
+  try {
+    return new (p) leaf_node(this);
+  } catch (...) {
+    _leaf_pool.deallocate(p);
+    throw;
+  }
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+auto btree<K, V, B, C, P>::new_internal() -> internal_node * {
+  auto p = _internal_pool.allocate();
+  try {
+    return new (p) internal_node(this);
+  } catch (...) {
+    _internal_pool.deallocate(p);
+    throw;
+  }
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+btree<K, V, B, C, P>::btree() : btree(C()) {}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+btree<K, V, B, C, P>::btree(const C &comp)
+    : detail::compare_holder<C>(comp),
+      _leaf_pool(sizeof(leaf_node), P::huge_pages),
+      _internal_pool(sizeof(internal_node), P::huge_pages),
+      _root(new_leaf()), _current_root(_root.get()),
+      _rightmost(_root->as_leaf()) {}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename InputIt>
+btree<K, V, B, C, P>::btree(InputIt first, InputIt last, float fill,
+                            const C &comp)
+    : btree(comp) {
+  bulk_load(first, last, fill);
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename InputIt>
+void btree<K, V, B, C, P>::bulk_load(InputIt first, InputIt last, float fill) {
+  clear();
+  if (first == last) {
+    return;
+  }
+
+  // Internal nodes need at least two children for the levels to shrink, and
+  // nothing is packed below the minimum fill erase maintains.
+  auto per_node = [&](std::size_t capacity) {
+    return std::min(capacity,
+                    std::max<std::size_t>({2, min_entries(capacity),
+                                           std::size_t(capacity * fill)}));
+  };
+  auto min_size = min_entries(leaf_capacity);
+  auto per_leaf = per_node(leaf_capacity);
+
+  // Each node of the level being built, with the lowest key below it.
+  using level_item = std::tuple<key_type, node_ptr>;
+  std::vector<level_item> level;
+
+  // Fill the leaves, chaining them as we go.
+  leaf_node *prev = nullptr;
+  while (first != last) {
+    auto leaf = new_leaf();
+    node_ptr owned(leaf);
+    for (; leaf->_size < per_leaf && first != last; ++first) {
+      leaf->_keys.construct(leaf->_size, std::get<0>(*first));
+      try {
+        leaf->_values.construct(leaf->_size, std::get<1>(*first));
+      } catch (...) {
+        leaf->_keys.destroy(leaf->_size);
+        throw;
+      }
+      ++leaf->_size;
+    }
+    leaf->_prev = prev;
+    if (prev) {
+      prev->_next = leaf;
+    }
+    prev = leaf;
+    level.emplace_back(leaf->_keys[0], std::move(owned));
+  }
+
+  // We only find out the input has run out once the last leaf is started, so
+  // it may be underfull. Fold it into its predecessor if they fit in one
+  // node, otherwise even the two out.
+  if (level.size() > 1 && prev->_size < min_size) {
+    auto before = prev->_prev;
+    auto total = before->_size + prev->_size;
+    if (total <= leaf_capacity) {
+      before->absorb(prev);
+      level.pop_back();
+    } else {
+      auto moved = total / 2 - prev->_size;
+      prev->take(prev, 0, prev->_size, moved);
+      before->_size -= moved;
+      prev->take(before, before->_size, moved, 0);
+      prev->_size += moved;
+      std::get<0>(level.back()) = prev->_keys[0];
+    }
+  }
+
+  _rightmost = std::get<1>(level.back())->as_leaf();
+
+  // Each pass groups one level's nodes under a new level of internal nodes,
+  // until a single root is left. Here the number of nodes is known, so the
+  // last group can be sized up front instead of fixed afterwards.
+  min_size = min_entries(internal_capacity);
+  auto per_parent = per_node(internal_capacity);
+  while (level.size() > 1) {
+    std::vector<level_item> parents;
+    for (std::size_t i = 0; i < level.size();) {
+      auto remaining = level.size() - i;
+      auto count = std::min(per_parent, remaining);
+      if (remaining > count && remaining - count < min_size) {
+        count = remaining <= internal_capacity ? remaining : remaining / 2;
+      }
+      auto parent = new_internal();
+      node_ptr owned(parent);
+      auto lowest = std::get<0>(level[i]);
+      for (auto end = i + count; i < end; ++i) {
+        auto &child = std::get<1>(level[i]);
+        child->set_parent(parent);
+        // Every child but the first is preceded by its lowest key.
+        if (parent->_size) {
+          parent->_keys.construct(parent->_size - 1,
+                                  std::move(std::get<0>(level[i])));
+        }
+        parent->_children.construct(parent->_size++, std::move(child));
+        parent->resummarize(parent->_size - 1);
+      }
+      parents.emplace_back(std::move(lowest), std::move(owned));
+    }
+    level = std::move(parents);
+  }
+
+  set_root(std::move(std::get<1>(level.front())));
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+void btree<K, V, B, C, P>::clear() {
+  set_root(node_ptr(new_leaf()));
+  _rightmost = _root->as_leaf();
+  _appending = false;
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <std::size_t PageBytes>
+void btree<K, V, B, C, P>::save(const std::string &path) const {
+  detail::image_writer<K, V, PageBytes> writer(path, size());
+  for (auto leaf = _root->begin()._node; leaf; leaf = leaf->_next) {
+    for (std::size_t i = 0; i < leaf->_size; ++i) {
+      writer.add(leaf->_keys[i], leaf->_values[i]);
+    }
+  }
+  writer.finish();
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename Q>
+auto btree<K, V, B, C, P>::find_leaf(const Q &key) -> leaf_node * {
+  node *n = _root.get();
+  while (!n->is_leaf()) {
+    n = n->as_internal()->child_for(key);
+  }
+  return n->as_leaf();
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename Q>
+auto btree<K, V, B, C, P>::find_leaf(const Q &key, const key_type *&fence)
+    -> leaf_node * {
+  fence = nullptr;
+  node *n = _root.get();
+  while (!n->is_leaf()) {
+    auto in = n->as_internal();
+    auto index = internal_node::key_search::upper_bound(
+        in->_keys.data(), in->_size - 1, key, this->compare());
+    // Separators further down are tighter.
+    if (index + 1 < in->_size) {
+      fence = &in->_keys[index];
+    }
+    n = in->child(index);
+  }
+  return n->as_leaf();
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename InputIt>
+std::size_t btree<K, V, B, C, P>::insert_batch(InputIt first, InputIt last) {
+  if (P::concurrent) {
+    std::size_t added = 0;
+    for (; first != last; ++first) {
+      added += emplace_entry<P::unique_keys>(detail::ignore_entry(),
+                                             std::get<0>(*first),
+                                             std::get<1>(*first))
+                   .second;
+    }
+    return added;
+  }
+  return insert_batch(
+      first, last,
+      typename std::iterator_traits<InputIt>::iterator_category());
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename InputIt>
+std::size_t btree<K, V, B, C, P>::insert_batch(InputIt first, InputIt last,
+                                               std::input_iterator_tag) {
+  // Sort a copy, then move the entries from it into the leaves. The sort is
+  // stable so that equal keys keep their order.
+  std::vector<item_type> items;
+  for (; first != last; ++first) {
+    items.emplace_back(std::get<0>(*first), std::get<1>(*first));
+  }
+  auto &comp = this->compare();
+  std::stable_sort(items.begin(), items.end(),
+                   [&](const item_type &a, const item_type &b) {
+                     return comp(std::get<0>(a), std::get<0>(b));
+                   });
+  return insert_sorted(std::make_move_iterator(items.begin()),
+                       std::make_move_iterator(items.end()));
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename ForwardIt>
+std::size_t btree<K, V, B, C, P>::insert_batch(ForwardIt first, ForwardIt last,
+                                               std::forward_iterator_tag) {
+  auto &comp = this->compare();
+  bool sorted = std::is_sorted(first, last, [&](const auto &a, const auto &b) {
+    return comp(std::get<0>(a), std::get<0>(b));
+  });
+  if (sorted) {
+    return insert_sorted(first, last);
+  }
+  return insert_batch(first, last, std::input_iterator_tag());
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename ForwardIt>
+std::size_t btree<K, V, B, C, P>::insert_sorted(ForwardIt first,
+                                                ForwardIt last) {
+  auto &comp = this->compare();
+  std::size_t added = 0;
+  std::vector<std::pair<ForwardIt, std::size_t>> plan;
+  plan.reserve(leaf_capacity);
+  while (first != last) {
+    const key_type *fence = nullptr;
+    auto leaf = find_leaf(std::get<0>(*first), fence);
+    auto room = leaf_capacity - leaf->_size;
+
+    // Take the entries that belong in this leaf, as many as fit, and work
+    // out where each goes. Keys only grow, so one pass over the leaf does.
+    plan.clear();
+    // Entries are only ever referred to through iterators, since *it may
+    // return them by value.
+    std::size_t pos = 0;
+    auto previous = last;
+    auto it = first;
+    for (; it != last; ++it) {
+      auto &&entry = *it;
+      const key_type &key = std::get<0>(entry);
+      if (fence && !comp(key, *fence)) {
+        break;
+      }
+      if (P::unique_keys) {
+        while (pos < leaf->_size && comp(leaf->_keys[pos], key)) {
+          ++pos;
+        }
+        // Skip keys already in the tree (see leaf_node::find_equal) or
+        // earlier in the batch.
+        auto prev = leaf->_prev;
+        bool present =
+            (previous != last && !comp(std::get<0>(*previous), key)) ||
+            (pos < leaf->_size && !comp(key, leaf->_keys[pos])) ||
+            (pos == 0 && prev && !comp(prev->_keys[prev->_size - 1], key));
+        previous = it;
+        if (present) {
+          continue;
+        }
+      } else {
+        // After any equal keys, as insert does.
+        while (pos < leaf->_size && !comp(key, leaf->_keys[pos])) {
+          ++pos;
+        }
+      }
+      if (plan.size() == room) {
+        break;
+      }
+      plan.emplace_back(it, pos);
+    }
+    if (it == first) {
+      // The leaf is full; split it and look again.
+      leaf->split_for_insert(std::get<0>(*first));
+      continue;
+    }
+    leaf->merge(plan);
+    added += plan.size();
+    first = it;
+  }
+  return added;
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <bool Unique, typename Visit, typename KArg, typename... Args>
+auto btree<K, V, B, C, P>::emplace_entry(std::false_type, Visit visit,
+                                         KArg &&key, Args &&... args)
+    -> std::pair<iterator, bool> {
+  // A key not less than anything in the last leaf goes there. Only worth
+  // checking while inserts keep going there, since otherwise that leaf is
+  // likely not in cache.
+  leaf_node *leaf = nullptr;
+  if (P::append_split && _appending) {
+    auto last = _rightmost;
+    if (!last->_size ||
+        !this->compare()(key, last->_keys[last->_size - 1])) {
+      leaf = last;
+    }
+  }
+  if (!leaf) {
+    leaf = find_leaf(key);
+  }
+  if (Unique) {
+    auto found = leaf->find_equal(key);
+    if (found != end()) {
+      visit(found._node->_values[found._index], false);
+      if (!std::is_same<Visit, detail::ignore_entry>::value) {
+        update_summaries(found._node, 0);
+      }
+      return {found, false};
+    }
+  }
+  auto result =
+      leaf->emplace(std::forward<KArg>(key), std::forward<Args>(args)...);
+  visit(result._node->_values[result._index], true);
+  if (!std::is_same<Visit, detail::ignore_entry>::value) {
+    update_summaries(result._node, 0);
+  }
+  _appending = result._node == _rightmost;
+  return {result, true};
+}
+
+// Optimistic lock coupling. The descent holds no locks, only versions, and
+// every node is validated after the step that read from it. Full nodes are
+// split on the way down so that a split never has to propagate upwards: the
+// parent, which was not full when we passed it, is locked together with the
+// node being split and has room for the new sibling. After a split we start
+// over rather than reason about which half we ended up in.
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <bool Unique, typename Visit, typename KArg, typename... Args>
+auto btree<K, V, B, C, P>::emplace_entry(std::true_type, Visit visit,
+                                         KArg &&key, Args &&... args)
+    -> std::pair<iterator, bool> {
+  // Keys are trivially copyable here, and the copy stays put while a split
+  // moves the entry the argument may refer to.
+  const key_type k(key);
+  for (unsigned attempt = 0;; ++attempt) {
+    if (attempt) {
+      detail::restart_backoff(attempt);
+    }
+    bool restart = false;
+    node *n = root();
+    auto version = n->_lock.read_lock_or_restart(restart);
+    if (restart || n != root()) {
+      continue;
+    }
+
+    internal_node *parent = nullptr;
+    std::uint64_t parent_version = 0;
+    for (;;) {
+      if (n->full()) {
+        if (parent) {
+          parent->_lock.upgrade_to_write_lock_or_restart(parent_version,
+                                                         restart);
+          if (restart) {
+            break;
+          }
+        }
+        n->_lock.upgrade_to_write_lock_or_restart(version, restart);
+        if (restart) {
+          if (parent) {
+            parent->_lock.write_unlock();
+          }
+          break;
+        }
+        if (!parent && n != root()) {
+          // Someone split the root after we read it, so we have a parent now
+          // that we did not lock.
+          n->_lock.write_unlock();
+          restart = true;
+          break;
+        }
+        // A leaf split also relinks the next leaf's _prev, which an insert
+        // holding only that leaf's lock reads, so it gets locked as well.
+        leaf_node *next = n->is_leaf() ? n->as_leaf()->_next : nullptr;
+        if (next) {
+          auto next_version = next->_lock.read_lock_or_restart(restart);
+          if (!restart) {
+            next->_lock.upgrade_to_write_lock_or_restart(next_version,
+                                                         restart);
+          }
+          if (restart) {
+            n->_lock.write_unlock();
+            if (parent) {
+              parent->_lock.write_unlock();
+            }
+            break;
+          }
+        }
+        if (n->is_leaf()) {
+          n->as_leaf()->split_for_insert(k);
+        } else {
+          n->as_internal()->split_for_insert();
+        }
+        if (next) {
+          next->_lock.write_unlock();
+        }
+        n->_lock.write_unlock();
+        if (parent) {
+          parent->_lock.write_unlock();
+        }
+        restart = true;
+        break;
+      }
+      if (n->is_leaf()) {
+        break;
+      }
+
+      auto inner = n->as_internal();
+      if (parent) {
+        parent->_lock.read_unlock_or_restart(parent_version, restart);
+        if (restart) {
+          break;
+        }
+      }
+      parent = inner;
+      parent_version = version;
+      n = inner->child_for(k);
+      inner->_lock.check_or_restart(version, restart);
+      if (restart) {
+        break;
+      }
+      version = n->_lock.read_lock_or_restart(restart);
+      if (restart) {
+        break;
+      }
+    }
+    if (restart) {
+      continue;
+    }
+
+    // Only the leaf gets locked. Validating the parent afterwards makes sure
+    // the leaf was not split away from under us before we locked it.
+    auto leaf = n->as_leaf();
+    leaf->_lock.upgrade_to_write_lock_or_restart(version, restart);
+    if (restart) {
+      continue;
+    }
+    if (parent) {
+      parent->_lock.read_unlock_or_restart(parent_version, restart);
+      if (restart) {
+        leaf->_lock.write_unlock();
+        continue;
+      }
+    }
+    // Not full, or the version would have moved. An existing entry with the
+    // key is here, or with duplicate keys allowed, it can end a run of
+    // equal keys in the previous leaf (see leaf_node::find_equal), when an
+    // earlier erase took the rest of the run out of this one. That leaf
+    // then stays locked until the entry is added, so that no one adds the
+    // key to it in between. Locks are only ever tried, never waited for,
+    // so taking them right to left here and left to right in a split cannot
+    // deadlock.
+    leaf_node *prev = nullptr;
+    if (Unique) {
+      auto &comp = this->compare();
+      auto index = leaf->lower_bound(k);
+      if (index < leaf->_size && !comp(k, leaf->_keys[index])) {
+        visit(leaf->_values[index], false);
+        leaf->_lock.write_unlock();
+        return {iterator(leaf, index), false};
+      }
+      if (!P::unique_keys && index == 0 && leaf->_prev) {
+        prev = leaf->_prev;
+        auto prev_version = prev->_lock.read_lock_or_restart(restart);
+        if (!restart) {
+          prev->_lock.upgrade_to_write_lock_or_restart(prev_version, restart);
+        }
+        if (restart) {
+          leaf->_lock.write_unlock();
+          continue;
+        }
+        if (prev->_next != leaf) {
+          // Split since we read the link.
+          prev->_lock.write_unlock();
+          leaf->_lock.write_unlock();
+          continue;
+        }
+        auto last = prev->_size - 1;
+        if (prev->_size && !comp(prev->_keys[last], k)) {
+          visit(prev->_values[last], false);
+          prev->_lock.write_unlock();
+          leaf->_lock.write_unlock();
+          return {iterator(prev, last), false};
+        }
+      }
+    }
+    auto result = leaf->emplace(k, std::forward<Args>(args)...);
+    visit(result._node->_values[result._index], true);
+    if (prev) {
+      prev->_lock.write_unlock();
+    }
+    leaf->_lock.write_unlock();
+    return {result, true};
+  }
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename Q>
+auto btree<K, V, B, C, P>::lookup(const Q &key, value_type &value)
+    -> if_probe<Q, bool> {
+  for (unsigned attempt = 0;; ++attempt) {
+    if (attempt) {
+      detail::restart_backoff(attempt);
+    }
+    bool restart = false;
+    node *n = root();
+    auto version = n->_lock.read_lock_or_restart(restart);
+    if (restart || n != root()) {
+      continue;
+    }
+
+    internal_node *parent = nullptr;
+    std::uint64_t parent_version = 0;
+    while (!n->is_leaf()) {
+      auto inner = n->as_internal();
+      if (parent) {
+        parent->_lock.read_unlock_or_restart(parent_version, restart);
+        if (restart) {
+          break;
+        }
+      }
+      parent = inner;
+      parent_version = version;
+      n = inner->child_for(key);
+      inner->_lock.check_or_restart(version, restart);
+      if (restart) {
+        break;
+      }
+      version = n->_lock.read_lock_or_restart(restart);
+      if (restart) {
+        break;
+      }
+    }
+    if (restart) {
+      continue;
+    }
+
+    auto &comp = this->compare();
+    auto leaf = n->as_leaf();
+    auto index = leaf->lower_bound(key);
+    bool found = index < leaf->_size && !comp(key, leaf->_keys[index]);
+    if (found) {
+      value = leaf->_values[index];
+    } else if (!P::unique_keys && index == 0 && leaf->_prev) {
+      // As in leaf_node::find_equal: the last entry of the previous leaf can
+      // be all that an erase left of a run of equal keys. Inserts never free
+      // a leaf, so reading it is safe once its version is validated.
+      auto prev = leaf->_prev;
+      auto prev_version = prev->_lock.read_lock_or_restart(restart);
+      auto size = prev->_size;
+      if (!restart && size && !comp(prev->_keys[size - 1], key)) {
+        found = true;
+        value = prev->_values[size - 1];
+      }
+      prev->_lock.read_unlock_or_restart(prev_version, restart);
+    }
+    if (parent) {
+      parent->_lock.read_unlock_or_restart(parent_version, restart);
+    }
+    leaf->_lock.read_unlock_or_restart(version, restart);
+    if (!restart) {
+      return found;
+    }
+  }
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <bool Find, typename ForwardIt, typename OutputIt>
+OutputIt btree<K, V, B, C, P>::batch_search(ForwardIt first, ForwardIt last,
+                                            OutputIt out) {
+  // Enough probes in flight to cover a miss with work on the others, few
+  // enough that what they have loaded is still in L1 at their next step.
+  constexpr std::size_t group = 16;
+
+  // All leaves are at the same depth, so every probe takes this many steps
+  // and we know when the nodes being prefetched are leaves.
+  std::size_t height = 0;
+  for (node *n = _root.get(); !n->is_leaf(); n = n->as_internal()->child(0)) {
+    ++height;
+  }
+
+  auto &comp = this->compare();
+  ForwardIt keys[group];
+  node *nodes[group];
+  while (first != last) {
+    std::size_t count = 0;
+    for (; count < group && first != last; ++count, ++first) {
+      keys[count] = first;
+      nodes[count] = _root.get();
+    }
+    // Descend as lower_bound does, one level at a time for the whole group.
+    for (std::size_t level = 0; level < height; ++level) {
+      bool leaves_next = level + 1 == height;
+      for (std::size_t i = 0; i < count; ++i) {
+        auto in = nodes[i]->as_internal();
+        auto index = internal_node::key_search::lower_bound(
+            in->_keys.data(), in->_size - 1, *keys[i], comp);
+        auto child = in->child(index);
+        if (leaves_next) {
+          child->as_leaf()->prefetch();
+        } else {
+          child->as_internal()->prefetch();
+        }
+        nodes[i] = child;
+      }
+    }
+    for (std::size_t i = 0; i < count; ++i) {
+      auto leaf = nodes[i]->as_leaf();
+      auto &key = *keys[i];
+      auto iter = leaf_node::iterator_at(leaf, leaf->lower_bound(key));
+      if (Find && iter != end() &&
+          comp(key, iter._node->_keys[iter._index])) {
+        iter = end();
+      }
+      *out++ = iter;
+    }
+  }
+  return out;
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+auto btree<K, V, B, C, P>::search(key_type key) -> iterator {
+  return lower_bound(key);
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename Q>
+auto btree<K, V, B, C, P>::find(const Q &key) -> if_probe<Q, iterator> {
+  auto iter = lower_bound(key);
+  if (iter != end() && this->compare()(key, iter._node->_keys[iter._index])) {
+    return end();
+  }
+  return iter;
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename Q>
+auto btree<K, V, B, C, P>::lower_bound(const Q &key) -> if_probe<Q, iterator> {
+  // Duplicates of a separator can sit on both sides of it, so descend into
+  // the child left of the first separator not less than the key rather than
+  // the one child_for picks.
+  node *n = _root.get();
+  while (!n->is_leaf()) {
+    auto in = n->as_internal();
+    auto index = internal_node::key_search::lower_bound(
+        in->_keys.data(), in->_size - 1, key, this->compare());
+    n = in->child(index);
+  }
+  auto leaf = n->as_leaf();
+  return leaf_node::iterator_at(leaf, leaf->lower_bound(key));
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename Q>
+auto btree<K, V, B, C, P>::upper_bound(const Q &key) -> if_probe<Q, iterator> {
+  auto leaf = find_leaf(key);
+  return leaf_node::iterator_at(leaf, leaf->upper_bound(key));
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename Q>
+auto btree<K, V, B, C, P>::equal_range(const Q &key)
+    -> if_probe<Q, std::pair<iterator, iterator>> {
+  auto &comp = this->compare();
+  auto first = lower_bound(key);
+  if (first == end() || comp(key, first._node->_keys[first._index])) {
+    return {first, first};
+  }
+  // Unless the run of equal keys reaches the end of this leaf, it ends in it.
+  auto leaf = first._node;
+  if (comp(key, leaf->_keys[leaf->_size - 1])) {
+    return {first, iterator(leaf, leaf->upper_bound(key))};
+  }
+  return {first, upper_bound(key)};
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename Q, typename R, typename F>
+auto btree<K, V, B, C, P>::scan(const Q &lo, const R &hi, F &&f)
+    -> if_probe<Q, if_probe<R, std::size_t>> {
+  auto &comp = this->compare();
+  std::size_t count = 0;
+  auto first = lower_bound(lo);
+  auto leaf = first._node;
+  auto index = first._index;
+  for (; leaf; leaf = leaf->_next, index = 0) {
+    const key_type *keys = leaf->_keys.data();
+    value_type *values = leaf->_values.data();
+    auto size = leaf->_size;
+    // Compare every entry against `hi` rather than looking at the leaf's last
+    // key up front: most scans are short, and that key is often on a cache
+    // line the scan would never touch.
+    for (; index < size; ++index) {
+      if (!comp(keys[index], hi)) {
+        return count;
+      }
+      ++count;
+      if (!detail::visit(f, keys[index], values[index])) {
+        return count;
+      }
+    }
+  }
+  return count;
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+std::size_t btree<K, V, B, C, P>::erase(const key_type &key) {
+  std::size_t count = 0;
+  auto iter = lower_bound(key);
+  while (iter != end() && !this->compare()(key, std::get<0>(*iter))) {
+    iter = erase(iter);
+    ++count;
+  }
+  return count;
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+auto btree<K, V, B, C, P>::erase(iterator pos) -> iterator {
+  return pos._node->erase(pos._index);
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+auto btree<K, V, B, C, P>::erase(iterator first, iterator last) -> iterator {
+  // Rebalancing moves entries between nodes, which invalidates `last`, so
+  // count the entries up front.
+  auto count = std::distance(first, last);
+  while (count--) {
+    first = erase(first);
+  }
+  return first;
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+void btree<K, V, B, C, P>::set_min_fill(float min_fill) {
+  _min_fill = std::min(std::max(min_fill, 0.0f), 0.5f);
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+std::size_t btree<K, V, B, C, P>::split_point(std::size_t size, bool append) {
+  if (append) {
+    return size - 1;
+  }
+  auto point = static_cast<std::size_t>(size * P::split_ratio);
+  return std::min(std::max<std::size_t>(point, 1), size - 1);
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+std::size_t btree<K, V, B, C, P>::min_entries(std::size_t capacity) const {
+  return std::max<std::size_t>(1, capacity * _min_fill);
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+auto btree<K, V, B, C, P>::root() const -> node * {
+  return _current_root.load(std::memory_order_acquire);
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+void btree<K, V, B, C, P>::set_root(node_ptr root) {
+  _root = std::move(root);
+  _current_root.store(_root.get(), std::memory_order_release);
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+void btree<K, V, B, C, P>::grow_root(key_type separator, node_ptr right) {
+  auto new_root = node_ptr(new_internal());
+  auto inner = new_root->as_internal();
+  _root->set_parent(inner);
+  right->set_parent(inner);
+  inner->_keys.construct(0, std::move(separator));
+  inner->_children.construct(0, std::move(_root));
+  inner->_children.construct(1, std::move(right));
+  inner->_size = 2;
+  inner->resummarize(0);
+  inner->resummarize(1);
+  set_root(std::move(new_root));
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+void btree<K, V, B, C, P>::collapse_root() {
+  while (!_root->is_leaf() && _root->as_internal()->_size == 1) {
+    // Moving the child out first keeps it alive through the old root's
+    // destruction.
+    auto child = std::move(_root->as_internal()->_children[0]);
+    child->set_parent(nullptr);
+    set_root(std::move(child));
+  }
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+void btree<K, V, B, C, P>::update_summaries(node *n, std::ptrdiff_t added) {
+  if (!aggregating && (!P::order_statistics || !added)) {
+    return;
+  }
+  for (auto parent = n->parent(); parent; n = parent, parent = n->parent()) {
+    auto index = parent->index_of(n);
+    if (P::order_statistics) {
+      parent->_counts[index] += added;
+    }
+    if (aggregating) {
+      parent->_aggregates[index] = n->aggregate();
+    }
+  }
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+std::size_t btree<K, V, B, C, P>::size() const {
+  if (P::order_statistics) {
+    return _root->entries();
+  }
+  std::size_t total = 0;
+  for (auto leaf = _root->begin()._node; leaf; leaf = leaf->_next) {
+    total += leaf->_size;
+  }
+  return total;
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+bool btree<K, V, B, C, P>::empty() const {
+  // Only the root leaf is ever empty.
+  return _rightmost->_size == 0;
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename Q>
+auto btree<K, V, B, C, P>::rank(const Q &key) -> if_probe<Q, std::size_t> {
+  static_assert(P::order_statistics, "rank needs order_statistics");
+  // The same descent as lower_bound, counting the entries left of it.
+  std::size_t rank = 0;
+  node *n = _root.get();
+  while (!n->is_leaf()) {
+    auto in = n->as_internal();
+    auto index = internal_node::key_search::lower_bound(
+        in->_keys.data(), in->_size - 1, key, this->compare());
+    for (std::size_t i = 0; i < index; ++i) {
+      rank += in->_counts[i];
+    }
+    n = in->child(index);
+  }
+  return rank + n->as_leaf()->lower_bound(key);
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+auto btree<K, V, B, C, P>::select(std::size_t position) -> iterator {
+  static_assert(P::order_statistics, "select needs order_statistics");
+  if (position >= size()) {
+    return end();
+  }
+  node *n = _root.get();
+  while (!n->is_leaf()) {
+    auto in = n->as_internal();
+    std::size_t index = 0;
+    for (; position >= in->_counts[index]; ++index) {
+      position -= in->_counts[index];
+    }
+    n = in->child(index);
+  }
+  return iterator(n->as_leaf(), position);
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename Q, typename R>
+auto btree<K, V, B, C, P>::count(const Q &lo, const R &hi)
+    -> if_probe<Q, if_probe<R, std::size_t>> {
+  static_assert(P::order_statistics, "count needs order_statistics");
+  if (!this->compare()(lo, hi)) {
+    return 0;
+  }
+  return rank(hi) - rank(lo);
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename Q, typename R>
+auto btree<K, V, B, C, P>::aggregate(const Q &lo, const R &hi)
+    -> if_probe<Q, if_probe<R, aggregate_type>> {
+  static_assert(aggregating, "aggregate needs btree_policy::aggregate");
+  if (!this->compare()(lo, hi)) {
+    return aggregate_ops::identity();
+  }
+  return aggregate_range(_root.get(), &lo, &hi);
+}
+
+template <typename K, typename V, std::size_t B, typename C, typename P>
+template <typename Q, typename R>
+auto btree<K, V, B, C, P>::aggregate_range(node *n, const Q *lo, const R *hi)
+    -> aggregate_type {
+  if (n->is_leaf()) {
+    auto leaf = n->as_leaf();
+    auto first = lo ? leaf->lower_bound(*lo) : 0;
+    auto last = hi ? leaf->lower_bound(*hi) : leaf->_size;
+    auto result = aggregate_ops::identity();
+    for (auto i = first; i < last; ++i) {
+      result = aggregate_ops::combine(
+          result, aggregate_ops::of(leaf->_keys[i], leaf->_values[i]));
+    }
+    return result;
+  }
+  // Children are picked as lower_bound does. Those strictly between the one
+  // lo leads to and the one hi leads to are entirely in the range.
+  auto &comp = this->compare();
+  auto in = n->as_internal();
+  auto first = lo ? internal_node::key_search::lower_bound(
+                        in->_keys.data(), in->_size - 1, *lo, comp)
+                  : 0;
+  auto last = hi ? internal_node::key_search::lower_bound(
+                       in->_keys.data(), in->_size - 1, *hi, comp)
+                 : in->_size - 1;
+  if (first == last) {
+    return aggregate_range(in->child(first), lo, hi);
+  }
+  const Q *open_lo = nullptr;
+  const R *open_hi = nullptr;
+  auto result = aggregate_range(in->child(first), lo, open_hi);
+  for (auto i = first + 1; i < last; ++i) {
+    result = aggregate_ops::combine(result, in->_aggregates[i]);
+  }
+  return aggregate_ops::combine(
+      result, aggregate_range(in->child(last), open_lo, hi));
+}
 
-template <typename K, typename V, std::size_t B, typename C>
-auto btree<K, V, B, C>::insert(key_type key, value_type value) -> iterator {
-  return _root->insert(key, value);
+template <typename K, typename V, std::size_t B, typename C, typename P>
+void btree<K, V, B, C, P>::refresh(iterator pos) {
+  update_summaries(pos._node, 0);
 }
 
-template <typename K, typename V, std::size_t B, typename C>
-auto btree<K, V, B, C>::end() -> iterator {
-  return iterator();
+template <typename K, typename V, std::size_t B, typename C, typename P>
+auto btree<K, V, B, C, P>::end() -> iterator {
+  return iterator(_rightmost, _rightmost->_size);
 }
 
-template <typename K, typename V, std::size_t B, typename C>
-auto btree<K, V, B, C>::begin() -> iterator {
+template <typename K, typename V, std::size_t B, typename C, typename P>
+auto btree<K, V, B, C, P>::begin() -> iterator {
   return _root->begin();
 }
 
-template <typename K, typename V, std::size_t B, typename C>
-std::ostream &btree<K, V, B, C>::print(std::ostream &os) {
+template <typename K, typename V, std::size_t B, typename C, typename P>
+std::ostream &btree<K, V, B, C, P>::print(std::ostream &os) {
   return _root->print(os);
 }
 
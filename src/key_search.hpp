@@ -0,0 +1,483 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AMIDVIDY_X86_SIMD 1
+#include <immintrin.h>
+#define AMIDVIDY_TARGET(isa) __attribute__((target(isa)))
+#else
+#define AMIDVIDY_X86_SIMD 0
+#endif
+
+namespace amidvidy {
+namespace detail {
+
+// In-node key search.
+//
+// Keys live in a node at a fixed byte stride (sizeof(K) for a contiguous key
+// array, or the size of a whole slot when keys are interleaved with other
+// data). A search narrows the range with a branchless binary search until
+// only a small window is left and then counts the keys in that window that
+// sort before the probe. For arithmetic keys ordered by std::less the count is
+// done with SSE4.2 or AVX2 compares, picked at runtime from CPUID, comparing
+// several keys per instruction. Anything else goes through the comparator,
+// which may also take probes of another type when it is transparent.
+
+enum class simd_level { scalar, sse42, avx2 };
+
+inline simd_level detect_simd_level() {
+#if AMIDVIDY_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return simd_level::avx2;
+  }
+  if (__builtin_cpu_supports("sse4.2")) {
+    return simd_level::sse42;
+  }
+#endif
+  return simd_level::scalar;
+}
+
+inline simd_level cpu_simd_level() {
+  static const simd_level level = detect_simd_level();
+  return level;
+}
+
+inline void prefetch(const void *p) {
+#if defined(__GNUC__)
+  __builtin_prefetch(p);
+#else
+  (void)p;
+#endif
+}
+
+template <typename K, std::size_t Stride>
+inline const K &key_at(const char *base, std::size_t i) {
+  return *reinterpret_cast<const K *>(base + i * Stride);
+}
+
+// Counts the keys in the window that are less than (or, for an upper bound,
+// not greater than) the probe.
+template <bool Upper, typename K, std::size_t Stride, typename Q,
+          typename Compare>
+inline std::size_t count_scalar(const char *base, std::size_t n, const Q &key,
+                                const Compare &comp) {
+  std::size_t count = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    const K &k = key_at<K, Stride>(base, i);
+    count += Upper ? !comp(key, k) : comp(k, key);
+  }
+  return count;
+}
+
+#if AMIDVIDY_X86_SIMD
+
+// Reads a key for a strided vector load. Goes through memcpy because the
+// vector key type may differ from the stored one (long vs long long).
+template <typename T, std::size_t Stride>
+inline T load_key(const char *base, std::size_t i) {
+  T key;
+  std::memcpy(&key, base + i * Stride, sizeof(T));
+  return key;
+}
+
+// count_scalar for the keys a vector count leaves over, read through
+// load_key for the same reason.
+template <bool Upper, typename T, std::size_t Stride>
+inline std::size_t count_loaded(const char *base, std::size_t n, T key) {
+  std::size_t count = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    auto k = load_key<T, Stride>(base, i);
+    count += Upper ? !(key < k) : k < key;
+  }
+  return count;
+}
+
+// Per key type vector operations. Each provides a lane count, a splat, a
+// contiguous and a strided load, and lane masks for "less than" and "less
+// than or equal".
+
+struct avx2_i64 {
+  using key_type = std::int64_t;
+  using vec_type = __m256i;
+  static constexpr std::size_t lanes = 4;
+
+  AMIDVIDY_TARGET("avx2") static vec_type splat(key_type key) {
+    return _mm256_set1_epi64x(key);
+  }
+  AMIDVIDY_TARGET("avx2") static vec_type load(const char *p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  }
+  template <std::size_t Stride>
+  AMIDVIDY_TARGET("avx2") static vec_type load_strided(const char *p) {
+    return _mm256_set_epi64x(load_key<key_type, Stride>(p, 3),
+                             load_key<key_type, Stride>(p, 2),
+                             load_key<key_type, Stride>(p, 1),
+                             load_key<key_type, Stride>(p, 0));
+  }
+  AMIDVIDY_TARGET("avx2") static unsigned lt(vec_type v, vec_type key) {
+    return _mm256_movemask_pd(
+        _mm256_castsi256_pd(_mm256_cmpgt_epi64(key, v)));
+  }
+  AMIDVIDY_TARGET("avx2") static unsigned le(vec_type v, vec_type key) {
+    return ~_mm256_movemask_pd(
+               _mm256_castsi256_pd(_mm256_cmpgt_epi64(v, key))) &
+           0xfu;
+  }
+};
+
+// Unsigned keys are compared as signed after flipping the sign bit.
+struct avx2_u64 {
+  using key_type = std::uint64_t;
+  using vec_type = __m256i;
+  static constexpr std::size_t lanes = 4;
+
+  AMIDVIDY_TARGET("avx2") static vec_type flip(vec_type v) {
+    return _mm256_xor_si256(
+        v, _mm256_set1_epi64x(static_cast<long long>(1ull << 63)));
+  }
+  AMIDVIDY_TARGET("avx2") static vec_type splat(key_type key) {
+    return flip(_mm256_set1_epi64x(static_cast<long long>(key)));
+  }
+  AMIDVIDY_TARGET("avx2") static vec_type load(const char *p) {
+    return flip(avx2_i64::load(p));
+  }
+  template <std::size_t Stride>
+  AMIDVIDY_TARGET("avx2") static vec_type load_strided(const char *p) {
+    return flip(avx2_i64::load_strided<Stride>(p));
+  }
+  AMIDVIDY_TARGET("avx2") static unsigned lt(vec_type v, vec_type key) {
+    return avx2_i64::lt(v, key);
+  }
+  AMIDVIDY_TARGET("avx2") static unsigned le(vec_type v, vec_type key) {
+    return avx2_i64::le(v, key);
+  }
+};
+
+struct avx2_i32 {
+  using key_type = std::int32_t;
+  using vec_type = __m256i;
+  static constexpr std::size_t lanes = 8;
+
+  AMIDVIDY_TARGET("avx2") static vec_type splat(key_type key) {
+    return _mm256_set1_epi32(key);
+  }
+  AMIDVIDY_TARGET("avx2") static vec_type load(const char *p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  }
+  template <std::size_t Stride>
+  AMIDVIDY_TARGET("avx2") static vec_type load_strided(const char *p) {
+    return _mm256_set_epi32(
+        load_key<key_type, Stride>(p, 7), load_key<key_type, Stride>(p, 6),
+        load_key<key_type, Stride>(p, 5), load_key<key_type, Stride>(p, 4),
+        load_key<key_type, Stride>(p, 3), load_key<key_type, Stride>(p, 2),
+        load_key<key_type, Stride>(p, 1), load_key<key_type, Stride>(p, 0));
+  }
+  AMIDVIDY_TARGET("avx2") static unsigned lt(vec_type v, vec_type key) {
+    return _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpgt_epi32(key, v)));
+  }
+  AMIDVIDY_TARGET("avx2") static unsigned le(vec_type v, vec_type key) {
+    return ~_mm256_movemask_ps(
+               _mm256_castsi256_ps(_mm256_cmpgt_epi32(v, key))) &
+           0xffu;
+  }
+};
+
+struct avx2_f64 {
+  using key_type = double;
+  using vec_type = __m256d;
+  static constexpr std::size_t lanes = 4;
+
+  AMIDVIDY_TARGET("avx2") static vec_type splat(key_type key) {
+    return _mm256_set1_pd(key);
+  }
+  AMIDVIDY_TARGET("avx2") static vec_type load(const char *p) {
+    return _mm256_loadu_pd(reinterpret_cast<const double *>(p));
+  }
+  template <std::size_t Stride>
+  AMIDVIDY_TARGET("avx2") static vec_type load_strided(const char *p) {
+    return _mm256_set_pd(
+        load_key<key_type, Stride>(p, 3), load_key<key_type, Stride>(p, 2),
+        load_key<key_type, Stride>(p, 1), load_key<key_type, Stride>(p, 0));
+  }
+  AMIDVIDY_TARGET("avx2") static unsigned lt(vec_type v, vec_type key) {
+    return _mm256_movemask_pd(_mm256_cmp_pd(v, key, _CMP_LT_OQ));
+  }
+  AMIDVIDY_TARGET("avx2") static unsigned le(vec_type v, vec_type key) {
+    return _mm256_movemask_pd(_mm256_cmp_pd(v, key, _CMP_LE_OQ));
+  }
+};
+
+struct sse42_i64 {
+  using key_type = std::int64_t;
+  using vec_type = __m128i;
+  static constexpr std::size_t lanes = 2;
+
+  AMIDVIDY_TARGET("sse4.2") static vec_type splat(key_type key) {
+    return _mm_set1_epi64x(key);
+  }
+  AMIDVIDY_TARGET("sse4.2") static vec_type load(const char *p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  }
+  template <std::size_t Stride>
+  AMIDVIDY_TARGET("sse4.2") static vec_type load_strided(const char *p) {
+    return _mm_set_epi64x(load_key<key_type, Stride>(p, 1),
+                          load_key<key_type, Stride>(p, 0));
+  }
+  AMIDVIDY_TARGET("sse4.2") static unsigned lt(vec_type v, vec_type key) {
+    return _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(key, v)));
+  }
+  AMIDVIDY_TARGET("sse4.2") static unsigned le(vec_type v, vec_type key) {
+    return ~_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(v, key))) & 0x3u;
+  }
+};
+
+struct sse42_u64 {
+  using key_type = std::uint64_t;
+  using vec_type = __m128i;
+  static constexpr std::size_t lanes = 2;
+
+  AMIDVIDY_TARGET("sse4.2") static vec_type flip(vec_type v) {
+    return _mm_xor_si128(
+        v, _mm_set1_epi64x(static_cast<long long>(1ull << 63)));
+  }
+  AMIDVIDY_TARGET("sse4.2") static vec_type splat(key_type key) {
+    return flip(_mm_set1_epi64x(static_cast<long long>(key)));
+  }
+  AMIDVIDY_TARGET("sse4.2") static vec_type load(const char *p) {
+    return flip(sse42_i64::load(p));
+  }
+  template <std::size_t Stride>
+  AMIDVIDY_TARGET("sse4.2") static vec_type load_strided(const char *p) {
+    return flip(sse42_i64::load_strided<Stride>(p));
+  }
+  AMIDVIDY_TARGET("sse4.2") static unsigned lt(vec_type v, vec_type key) {
+    return sse42_i64::lt(v, key);
+  }
+  AMIDVIDY_TARGET("sse4.2") static unsigned le(vec_type v, vec_type key) {
+    return sse42_i64::le(v, key);
+  }
+};
+
+struct sse42_i32 {
+  using key_type = std::int32_t;
+  using vec_type = __m128i;
+  static constexpr std::size_t lanes = 4;
+
+  AMIDVIDY_TARGET("sse4.2") static vec_type splat(key_type key) {
+    return _mm_set1_epi32(key);
+  }
+  AMIDVIDY_TARGET("sse4.2") static vec_type load(const char *p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  }
+  template <std::size_t Stride>
+  AMIDVIDY_TARGET("sse4.2") static vec_type load_strided(const char *p) {
+    return _mm_set_epi32(
+        load_key<key_type, Stride>(p, 3), load_key<key_type, Stride>(p, 2),
+        load_key<key_type, Stride>(p, 1), load_key<key_type, Stride>(p, 0));
+  }
+  AMIDVIDY_TARGET("sse4.2") static unsigned lt(vec_type v, vec_type key) {
+    return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(key, v)));
+  }
+  AMIDVIDY_TARGET("sse4.2") static unsigned le(vec_type v, vec_type key) {
+    return ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, key))) & 0xfu;
+  }
+};
+
+struct sse42_f64 {
+  using key_type = double;
+  using vec_type = __m128d;
+  static constexpr std::size_t lanes = 2;
+
+  AMIDVIDY_TARGET("sse4.2") static vec_type splat(key_type key) {
+    return _mm_set1_pd(key);
+  }
+  AMIDVIDY_TARGET("sse4.2") static vec_type load(const char *p) {
+    return _mm_loadu_pd(reinterpret_cast<const double *>(p));
+  }
+  template <std::size_t Stride>
+  AMIDVIDY_TARGET("sse4.2") static vec_type load_strided(const char *p) {
+    return _mm_set_pd(load_key<key_type, Stride>(p, 1),
+                      load_key<key_type, Stride>(p, 0));
+  }
+  AMIDVIDY_TARGET("sse4.2") static unsigned lt(vec_type v, vec_type key) {
+    return _mm_movemask_pd(_mm_cmplt_pd(v, key));
+  }
+  AMIDVIDY_TARGET("sse4.2") static unsigned le(vec_type v, vec_type key) {
+    return _mm_movemask_pd(_mm_cmple_pd(v, key));
+  }
+};
+
+template <typename Ops, std::size_t Stride>
+using is_contiguous =
+    std::integral_constant<bool, Stride == sizeof(typename Ops::key_type)>;
+
+// The two drivers are identical apart from the instruction set they are
+// compiled for, which has to be spelled out on each function for the vector
+// operations to inline.
+#define AMIDVIDY_DEFINE_COUNT_SIMD(name, isa)                                  \
+  template <typename Ops, std::size_t Stride>                                  \
+  AMIDVIDY_TARGET(isa)                                                         \
+  inline typename Ops::vec_type name##_load(const char *p, std::true_type) {   \
+    return Ops::load(p);                                                       \
+  }                                                                            \
+  template <typename Ops, std::size_t Stride>                                  \
+  AMIDVIDY_TARGET(isa)                                                         \
+  inline typename Ops::vec_type name##_load(const char *p, std::false_type) {  \
+    return Ops::template load_strided<Stride>(p);                              \
+  }                                                                            \
+  template <typename Ops, bool Upper, std::size_t Stride>                      \
+  AMIDVIDY_TARGET(isa)                                                         \
+  std::size_t name(const char *base, std::size_t n,                            \
+                   typename Ops::key_type key) {                               \
+    auto splat = Ops::splat(key);                                              \
+    std::size_t count = 0;                                                     \
+    std::size_t i = 0;                                                         \
+    for (; i + Ops::lanes <= n; i += Ops::lanes) {                             \
+      auto v = name##_load<Ops, Stride>(base + i * Stride,                     \
+                                        is_contiguous<Ops, Stride>());         \
+      unsigned mask = Upper ? Ops::le(v, splat) : Ops::lt(v, splat);           \
+      count += __builtin_popcount(mask);                                       \
+    }                                                                          \
+    return count + count_loaded<Upper, typename Ops::key_type, Stride>(        \
+                       base + i * Stride, n - i, key);                         \
+  }
+
+AMIDVIDY_DEFINE_COUNT_SIMD(count_avx2, "avx2")
+AMIDVIDY_DEFINE_COUNT_SIMD(count_sse42, "sse4.2")
+
+#undef AMIDVIDY_DEFINE_COUNT_SIMD
+
+// Maps a key type onto its vector operations. Integral keys are matched by
+// size and signedness so that long and long long share an implementation.
+template <typename K, typename = void> struct simd_ops {
+  static constexpr bool enabled = false;
+};
+
+template <typename K>
+struct simd_ops<K, std::enable_if_t<std::is_integral<K>::value &&
+                                    std::is_signed<K>::value &&
+                                    sizeof(K) == 8>> {
+  static constexpr bool enabled = true;
+  using avx2 = avx2_i64;
+  using sse42 = sse42_i64;
+};
+
+template <typename K>
+struct simd_ops<K, std::enable_if_t<std::is_integral<K>::value &&
+                                    std::is_unsigned<K>::value &&
+                                    sizeof(K) == 8>> {
+  static constexpr bool enabled = true;
+  using avx2 = avx2_u64;
+  using sse42 = sse42_u64;
+};
+
+template <typename K>
+struct simd_ops<K, std::enable_if_t<std::is_integral<K>::value &&
+                                    std::is_signed<K>::value &&
+                                    sizeof(K) == 4>> {
+  static constexpr bool enabled = true;
+  using avx2 = avx2_i32;
+  using sse42 = sse42_i32;
+};
+
+template <> struct simd_ops<double> {
+  static constexpr bool enabled = true;
+  using avx2 = avx2_f64;
+  using sse42 = sse42_f64;
+};
+
+#else
+
+template <typename K, typename = void> struct simd_ops {
+  static constexpr bool enabled = false;
+};
+
+#endif
+
+// Vector compares only agree with the tree's ordering when it is the natural
+// one, and the probe has to be a key itself to be splatted.
+template <typename K, typename Compare, typename Q = K>
+struct use_simd_search
+    : std::integral_constant<
+          bool, simd_ops<K>::enabled && std::is_same<K, Q>::value &&
+                    (std::is_same<Compare, std::less<K>>::value ||
+                     std::is_same<Compare, std::less<>>::value)> {};
+
+template <typename K, typename Compare, std::size_t Stride>
+class key_search {
+public:
+  // Index of the first key not less than the probe.
+  template <typename Q>
+  static std::size_t lower_bound(const K *first, std::size_t n, const Q &key,
+                                 const Compare &comp) {
+    return search<false>(reinterpret_cast<const char *>(first), n, key, comp);
+  }
+
+  // Index of the first key greater than the probe.
+  template <typename Q>
+  static std::size_t upper_bound(const K *first, std::size_t n, const Q &key,
+                                 const Compare &comp) {
+    return search<true>(reinterpret_cast<const char *>(first), n, key, comp);
+  }
+
+private:
+  // Below this many keys it is cheaper to compare everything than to keep
+  // halving: a cache line's worth when keys are contiguous, otherwise one
+  // vector's worth, since every strided key is a separate load.
+  static constexpr std::size_t window =
+      Stride == sizeof(K) && 64 / sizeof(K) > 4 ? 64 / sizeof(K) : 4;
+
+  template <bool Upper, typename Q>
+  static std::size_t search(const char *base, std::size_t n, const Q &key,
+                            const Compare &comp) {
+    std::size_t lo = 0;
+    while (n > window) {
+      std::size_t half = n / 2;
+      // Without a branch the next probe's load cannot be speculated, so fetch
+      // the candidates on both sides ahead of time.
+      prefetch(base + (lo + half / 2 - 1) * Stride);
+      prefetch(base + (lo + half + half / 2 - 1) * Stride);
+      const K &probe = key_at<K, Stride>(base, lo + half - 1);
+      bool before = Upper ? !comp(key, probe) : comp(probe, key);
+      lo = before ? lo + half : lo;
+      n -= half;
+    }
+    return lo + count<Upper>(base + lo * Stride, n, key, comp,
+                             use_simd_search<K, Compare, Q>());
+  }
+
+  template <bool Upper, typename Q>
+  static std::size_t count(const char *base, std::size_t n, const Q &key,
+                           const Compare &comp, std::false_type) {
+    return count_scalar<Upper, K, Stride>(base, n, key, comp);
+  }
+
+#if AMIDVIDY_X86_SIMD
+  template <bool Upper>
+  static std::size_t count(const char *base, std::size_t n, const K &key,
+                           const Compare &comp, std::true_type) {
+    using ops = simd_ops<K>;
+    using simd_key = typename ops::avx2::key_type;
+    switch (cpu_simd_level()) {
+    case simd_level::avx2:
+      return count_avx2<typename ops::avx2, Upper, Stride>(
+          base, n, static_cast<simd_key>(key));
+    case simd_level::sse42:
+      return count_sse42<typename ops::sse42, Upper, Stride>(
+          base, n, static_cast<simd_key>(key));
+    default:
+      return count_scalar<Upper, K, Stride>(base, n, key, comp);
+    }
+  }
+#endif
+};
+
+} // namespace detail
+} // namespace amidvidy
@@ -0,0 +1,354 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "btree.hpp"
+#include "page_layout.hpp"
+
+namespace amidvidy {
+
+// A read-only view of a tree file (see btree::save) that maps the file and
+// searches its pages where they lie, with nothing read or rebuilt up front:
+// opening costs the same for any size of file, and pages are faulted in by
+// the kernel as searches first touch them, then stay in the page cache,
+// shared with any other process mapping the file. Files written by
+// paged_btree can be opened too, once flushed.
+//
+// Searches, scans and iteration give references into the mapping, which
+// stay valid for as long as the mapped_btree does. Since nothing in the
+// mapping is written, any number of threads can use one at once.
+template <typename K, typename V, std::size_t PageBytes = 4096,
+          typename Compare = std::less<K>>
+class mapped_btree : private detail::compare_holder<Compare> {
+  using layout = detail::page_layout<K, V, PageBytes>;
+  using page_id = detail::page_id;
+  using page_header = typename layout::page_header;
+  using meta_page = typename layout::meta_page;
+  using leaf_page = typename layout::leaf_page;
+  using internal_page = typename layout::internal_page;
+
+public:
+  using key_type = K;
+  using value_type = V;
+  using key_compare = Compare;
+  using reference = std::tuple<const key_type &, const value_type &>;
+
+  static constexpr std::size_t page_bytes = PageBytes;
+
+  // Forward only.
+  class iterator;
+
+  // Maps the file at `path`, which must have been written with the same
+  // key, value and page sizes and a comparator that orders keys the same
+  // way. Throws std::system_error if it cannot be mapped and
+  // std::runtime_error if it is not such a file.
+  explicit mapped_btree(const std::string &path,
+                        const Compare &comp = Compare());
+
+  ~mapped_btree();
+
+  mapped_btree(const mapped_btree &) = delete;
+  mapped_btree &operator=(const mapped_btree &) = delete;
+
+  // The first entry with a key not less than this one; same as
+  // lower_bound.
+  iterator search(const key_type &key) const { return lower_bound(key); }
+
+  // The first entry with exactly this key, or end().
+  iterator find(const key_type &key) const;
+
+  iterator lower_bound(const key_type &key) const;
+
+  iterator upper_bound(const key_type &key) const;
+
+  // Copies the value of an entry with the key into `value`. Returns false,
+  // leaving `value` alone, if there is none.
+  bool lookup(const key_type &key, value_type &value) const;
+
+  // Calls f(key, value) for every entry with lo <= key < hi, in order, and
+  // returns how many entries were visited; stops early if f returns false.
+  template <typename F>
+  std::size_t scan(const key_type &lo, const key_type &hi, F &&f) const;
+
+  std::size_t size() const { return meta()->entries; }
+
+  bool empty() const { return size() == 0; }
+
+  iterator begin() const;
+  iterator end() const { return iterator(); }
+
+  key_compare key_comp() const { return this->compare(); }
+
+  // Pages in the file, the header page included.
+  std::size_t pages() const { return meta()->pages; }
+
+private:
+  using key_search = detail::key_search<key_type, Compare, sizeof(key_type)>;
+
+  template <typename T> const T *page(page_id id) const {
+    return reinterpret_cast<const T *>(_base + id * PageBytes);
+  }
+
+  const meta_page *meta() const { return page<meta_page>(0); }
+
+  // The node page with this number, after checking that it is one: within
+  // the file and no more full than a page can be. Page numbers come from
+  // the file, so a truncated or corrupt one throws std::runtime_error here
+  // rather than sending a search outside the mapping.
+  const page_header *node(page_id id) const;
+
+  // Like node, for a page that must be a leaf.
+  const leaf_page *leaf(page_id id) const;
+
+  // The leaf the descent for `key` ends in. With Upper, the child after
+  // any separators equal to the key, as for upper_bound; otherwise the
+  // child before them, as for lower_bound.
+  template <bool Upper> const leaf_page *find_leaf(const key_type &key) const;
+
+  const char *_base = nullptr;
+  std::size_t _bytes = 0;
+};
+
+template <typename K, typename V, std::size_t P, typename C>
+class mapped_btree<K, V, P, C>::iterator
+    : public std::iterator<std::forward_iterator_tag, std::tuple<K, V>,
+                           std::ptrdiff_t, void, reference> {
+public:
+  iterator() = default;
+
+  reference operator*() const {
+    return reference(_leaf->keys[_index], _leaf->values[_index]);
+  }
+
+  iterator &operator++() {
+    ++_index;
+    settle();
+    return *this;
+  }
+
+  iterator operator++(int) {
+    auto before = *this;
+    ++*this;
+    return before;
+  }
+
+  friend bool operator==(const iterator &lhs, const iterator &rhs) {
+    return lhs._leaf == rhs._leaf && lhs._index == rhs._index;
+  }
+
+  friend bool operator!=(const iterator &lhs, const iterator &rhs) {
+    return !(lhs == rhs);
+  }
+
+private:
+  friend class mapped_btree;
+
+  iterator(const mapped_btree *tree, const leaf_page *leaf,
+           std::size_t index)
+      : _tree(tree), _leaf(leaf), _index(index) {
+    settle();
+  }
+
+  // Moves on from one past the end of a leaf, and from empty leaves (which
+  // paged_btree's erase can leave), to the next entry or to end().
+  void settle() {
+    while (_leaf && _index == _leaf->header.size) {
+      auto next = _leaf->header.next;
+      _leaf = next ? _tree->leaf(next) : nullptr;
+      _index = 0;
+    }
+  }
+
+  const mapped_btree *_tree = nullptr;
+  const leaf_page *_leaf = nullptr;
+  std::size_t _index = 0;
+};
+
+template <typename K, typename V, std::size_t P, typename C>
+constexpr std::size_t mapped_btree<K, V, P, C>::page_bytes;
+
+template <typename K, typename V, std::size_t P, typename C>
+mapped_btree<K, V, P, C>::mapped_btree(const std::string &path, const C &comp)
+    : detail::compare_holder<C>(comp) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    detail::throw_errno("open " + path);
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    ::close(fd);
+    detail::throw_errno("fstat " + path);
+  }
+  _bytes = static_cast<std::size_t>(st.st_size);
+  if (_bytes < P) {
+    ::close(fd);
+    throw std::runtime_error("mapped_btree: " + path + " is not a tree file");
+  }
+  // The mapping keeps the file open by itself.
+  void *base = ::mmap(nullptr, _bytes, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (base == MAP_FAILED) {
+    detail::throw_errno("mmap " + path);
+  }
+  _base = static_cast<const char *>(base);
+  if (!layout::matches(meta()) || meta()->pages * P > _bytes) {
+    ::munmap(base, _bytes);
+    throw std::runtime_error(
+        "mapped_btree: " + path +
+        " is not a tree file with these key, value and page sizes");
+  }
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+mapped_btree<K, V, P, C>::~mapped_btree() {
+  ::munmap(const_cast<char *>(_base), _bytes);
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+auto mapped_btree<K, V, P, C>::node(page_id id) const -> const page_header * {
+  if (id == 0 || id >= meta()->pages) {
+    throw std::runtime_error("mapped_btree: corrupt tree file, page " +
+                             std::to_string(id) + " out of range");
+  }
+  auto header = page<page_header>(id);
+  auto capacity =
+      header->leaf ? layout::leaf_capacity : layout::internal_capacity + 1;
+  if (header->size > capacity || (!header->leaf && header->size == 0)) {
+    throw std::runtime_error("mapped_btree: corrupt tree file, page " +
+                             std::to_string(id) + " overfull");
+  }
+  return header;
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+auto mapped_btree<K, V, P, C>::leaf(page_id id) const -> const leaf_page * {
+  auto header = node(id);
+  if (!header->leaf) {
+    throw std::runtime_error("mapped_btree: corrupt tree file, page " +
+                             std::to_string(id) + " is not a leaf");
+  }
+  return reinterpret_cast<const leaf_page *>(header);
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+template <bool Upper>
+auto mapped_btree<K, V, P, C>::find_leaf(const key_type &key) const
+    -> const leaf_page * {
+  auto id = meta()->root;
+  // A descent that passes more pages than the file has is going round in
+  // circles.
+  for (page_id depth = 0;; ++depth) {
+    auto header = node(id);
+    if (header->leaf) {
+      return reinterpret_cast<const leaf_page *>(header);
+    }
+    if (depth >= meta()->pages) {
+      throw std::runtime_error("mapped_btree: corrupt tree file, cycle "
+                               "below page " +
+                               std::to_string(meta()->root));
+    }
+    auto in = reinterpret_cast<const internal_page *>(header);
+    auto keys = header->size - 1;
+    auto index =
+        Upper ? key_search::upper_bound(in->keys, keys, key, this->compare())
+              : key_search::lower_bound(in->keys, keys, key, this->compare());
+    id = in->children[index];
+  }
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+auto mapped_btree<K, V, P, C>::find(const key_type &key) const -> iterator {
+  auto iter = lower_bound(key);
+  if (iter != end() && this->compare()(key, std::get<0>(*iter))) {
+    return end();
+  }
+  return iter;
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+auto mapped_btree<K, V, P, C>::lower_bound(const key_type &key) const
+    -> iterator {
+  auto leaf = find_leaf<false>(key);
+  return iterator(this, leaf,
+                  key_search::lower_bound(leaf->keys, leaf->header.size, key,
+                                          this->compare()));
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+auto mapped_btree<K, V, P, C>::upper_bound(const key_type &key) const
+    -> iterator {
+  auto leaf = find_leaf<true>(key);
+  return iterator(this, leaf,
+                  key_search::upper_bound(leaf->keys, leaf->header.size, key,
+                                          this->compare()));
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+bool mapped_btree<K, V, P, C>::lookup(const key_type &key,
+                                      value_type &value) const {
+  auto iter = find(key);
+  if (iter == end()) {
+    return false;
+  }
+  value = std::get<1>(*iter);
+  return true;
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+template <typename F>
+std::size_t mapped_btree<K, V, P, C>::scan(const key_type &lo,
+                                           const key_type &hi,
+                                           F &&f) const {
+  auto &comp = this->compare();
+  std::size_t count = 0;
+  auto leaf = find_leaf<false>(lo);
+  auto index =
+      key_search::lower_bound(leaf->keys, leaf->header.size, lo, comp);
+  for (;;) {
+    for (auto size = leaf->header.size; index < size; ++index) {
+      if (!comp(leaf->keys[index], hi)) {
+        return count;
+      }
+      ++count;
+      if (!detail::visit(f, leaf->keys[index], leaf->values[index])) {
+        return count;
+      }
+    }
+    if (!leaf->header.next) {
+      return count;
+    }
+    leaf = this->leaf(leaf->header.next);
+    index = 0;
+  }
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+auto mapped_btree<K, V, P, C>::begin() const -> iterator {
+  auto id = meta()->root;
+  for (page_id depth = 0;; ++depth) {
+    auto header = node(id);
+    if (header->leaf) {
+      return iterator(this, reinterpret_cast<const leaf_page *>(header), 0);
+    }
+    if (depth >= meta()->pages) {
+      throw std::runtime_error("mapped_btree: corrupt tree file, cycle "
+                               "below page " +
+                               std::to_string(meta()->root));
+    }
+    id = reinterpret_cast<const internal_page *>(header)->children[0];
+  }
+}
+
+} // namespace amidvidy
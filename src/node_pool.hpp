@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace amidvidy {
+namespace detail {
+
+// Stands in for std::mutex when the pool is only used from one thread.
+struct null_mutex {
+  void lock() {}
+  void unlock() {}
+};
+
+// Hands out fixed-size, cache line aligned blocks for one kind of node. The
+// size is only given at runtime, since the tree's node types are not complete
+// yet where the tree declares its pools.
+//
+// Blocks are carved out of large slabs, so nodes allocated one after another
+// (the leaves a run of splits produces, say) end up next to each other in
+// memory rather than wherever the global allocator had room. Freed blocks go
+// on an intrusive free list and are reused before the slab is grown; memory
+// only goes back to the system when the pool is destroyed.
+//
+// Slabs start small and double, so a tree with a handful of nodes does not
+// pay for a big slab. With huge pages, every slab is a 2MiB huge page
+// instead, which saves TLB misses on large trees; where the system has none
+// to give, they are ordinary pages.
+template <typename Mutex = null_mutex> class node_pool {
+public:
+  static constexpr std::size_t alignment = 64;
+
+  explicit node_pool(std::size_t size, bool huge_pages = false)
+      : _block_size((std::max(size, sizeof(free_block)) + alignment - 1) /
+                    alignment * alignment),
+        _huge_pages(huge_pages) {}
+
+  node_pool(const node_pool &) = delete;
+  node_pool &operator=(const node_pool &) = delete;
+
+  ~node_pool() {
+    for (auto &slab : _slabs) {
+      release(slab);
+    }
+  }
+
+  void *allocate() {
+    std::lock_guard<Mutex> guard(_mutex);
+    if (_free) {
+      auto block = _free;
+      _free = _free->next;
+      return block;
+    }
+    if (_bump == _bump_end) {
+      grow();
+    }
+    auto block = _bump;
+    _bump += _block_size;
+    return block;
+  }
+
+  void deallocate(void *p) {
+    std::lock_guard<Mutex> guard(_mutex);
+    auto block = static_cast<free_block *>(p);
+    block->next = _free;
+    _free = block;
+  }
+
+  std::size_t block_size() const { return _block_size; }
+
+  // Bytes taken from the system, including blocks not handed out yet.
+  std::size_t reserved() const {
+    std::size_t bytes = 0;
+    for (auto &slab : _slabs) {
+      bytes += slab.size;
+    }
+    return bytes;
+  }
+
+private:
+  struct free_block {
+    free_block *next;
+  };
+
+  struct slab {
+    void *memory;
+    std::size_t size;
+    bool mapped;
+  };
+
+  static constexpr std::size_t huge_page_size = std::size_t(2) << 20;
+  static constexpr std::size_t max_slab_size = std::size_t(1) << 20;
+
+  void grow() {
+    // Make room first so that a failure cannot leak the new slab.
+    _slabs.reserve(_slabs.size() + 1);
+    auto next = allocate_slab();
+    _slabs.push_back(next);
+    _bump = static_cast<char *>(next.memory);
+    _bump_end = _bump + next.size / _block_size * _block_size;
+  }
+
+  slab allocate_slab() {
+#if defined(__linux__)
+    if (_huge_pages) {
+      // Over-map so the slab can be trimmed to a huge page boundary.
+      auto size = (_block_size + huge_page_size - 1) / huge_page_size *
+                  huge_page_size;
+      auto bytes = size + huge_page_size;
+      void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      auto base = reinterpret_cast<std::uintptr_t>(p);
+      auto aligned = (base + huge_page_size - 1) & ~(huge_page_size - 1);
+      if (aligned != base) {
+        munmap(p, aligned - base);
+      }
+      if (auto tail = base + bytes - (aligned + size)) {
+        munmap(reinterpret_cast<void *>(aligned + size), tail);
+      }
+      p = reinterpret_cast<void *>(aligned);
+#if defined(MADV_HUGEPAGE)
+      madvise(p, size, MADV_HUGEPAGE);
+#endif
+      return {p, size, true};
+    }
+#endif
+    // Double each time, starting from a few blocks.
+    std::size_t blocks =
+        _slabs.empty() ? 4 : _slabs.back().size / _block_size * 2;
+    if (blocks * _block_size > max_slab_size) {
+      blocks = std::max<std::size_t>(max_slab_size / _block_size, 1);
+    }
+    auto size = blocks * _block_size;
+    void *p = nullptr;
+    if (posix_memalign(&p, alignment, size) != 0) {
+      throw std::bad_alloc();
+    }
+    return {p, size, false};
+  }
+
+  static void release(const slab &s) {
+#if defined(__linux__)
+    if (s.mapped) {
+      munmap(s.memory, s.size);
+      return;
+    }
+#endif
+    std::free(s.memory);
+  }
+
+  std::size_t _block_size;
+  Mutex _mutex;
+  free_block *_free = nullptr;
+  char *_bump = nullptr;
+  char *_bump_end = nullptr;
+  std::vector<slab> _slabs;
+  bool _huge_pages;
+};
+
+} // namespace detail
+} // namespace amidvidy
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "buffer_pool.hpp"
+
+namespace amidvidy {
+namespace detail {
+
+// The file format of paged_btree, which btree::save also writes and
+// mapped_btree reads. Page 0 is a header (meta_page); every other page is a
+// node, a leaf or an internal page. Nodes refer to each other by page
+// number, never by address, so a file means the same wherever it is read
+// or mapped.
+template <typename K, typename V, std::size_t PageBytes> struct page_layout {
+  static_assert(std::is_trivially_copyable<K>::value &&
+                    std::is_trivially_copyable<V>::value,
+                "tree files store keys and values as bytes, so they must be "
+                "trivially copyable");
+
+  // The start of every node page.
+  struct page_header {
+    std::uint32_t leaf;
+    // Entries of a leaf, children of an internal page.
+    std::uint32_t size;
+    // Sibling leaves, or 0.
+    page_id next;
+    page_id prev;
+  };
+
+  // Entries per leaf page.
+  static constexpr std::size_t leaf_capacity =
+      (PageBytes - sizeof(page_header) - alignof(V)) / (sizeof(K) + sizeof(V));
+
+  // Keys per internal page, which has one more child than that.
+  static constexpr std::size_t internal_capacity =
+      (PageBytes - sizeof(page_header) - sizeof(page_id) - alignof(K)) /
+      (sizeof(K) + sizeof(page_id));
+
+  static_assert(leaf_capacity >= 3 && internal_capacity >= 3,
+                "pages too small for these keys and values");
+
+  // Page 0.
+  struct meta_page {
+    char magic[8];
+    std::uint32_t format;
+    std::uint32_t page_bytes;
+    std::uint32_t key_bytes;
+    std::uint32_t value_bytes;
+    page_id root;
+    page_id pages;
+    std::uint64_t entries;
+    // The last durable_btree log record whose change the file has, or 0.
+    std::uint64_t checkpoint_lsn;
+  };
+
+  struct leaf_page {
+    page_header header;
+    K keys[leaf_capacity];
+    V values[leaf_capacity];
+  };
+
+  // keys[i] separates children[i] from children[i + 1]. Entries equal to a
+  // separator can be on both sides of it.
+  struct internal_page {
+    page_header header;
+    K keys[internal_capacity];
+    page_id children[internal_capacity + 1];
+  };
+
+  static_assert(sizeof(leaf_page) <= PageBytes &&
+                    sizeof(internal_page) <= PageBytes &&
+                    sizeof(meta_page) <= PageBytes,
+                "page layout does not fit the page size");
+  // Pages start at multiples of PageBytes, in the file and in a mapping.
+  static_assert(PageBytes % alignof(leaf_page) == 0 &&
+                    PageBytes % alignof(internal_page) == 0,
+                "page size not a multiple of the page alignment");
+
+  static constexpr std::uint32_t format = 1;
+
+  static void init(meta_page *m) {
+    std::memcpy(m->magic, "amidvbt", 8);
+    m->format = format;
+    m->page_bytes = PageBytes;
+    m->key_bytes = sizeof(K);
+    m->value_bytes = sizeof(V);
+  }
+
+  // Whether a header page is one that init would have written.
+  static bool matches(const meta_page *m) {
+    return std::memcmp(m->magic, "amidvbt", 8) == 0 && m->format == format &&
+           m->page_bytes == PageBytes && m->key_bytes == sizeof(K) &&
+           m->value_bytes == sizeof(V);
+  }
+};
+
+template <typename K, typename V, std::size_t P>
+constexpr std::size_t page_layout<K, V, P>::leaf_capacity;
+
+template <typename K, typename V, std::size_t P>
+constexpr std::size_t page_layout<K, V, P>::internal_capacity;
+
+template <typename K, typename V, std::size_t P>
+constexpr std::uint32_t page_layout<K, V, P>::format;
+
+// Writes a tree file from entries handed over in key order, packed: as few
+// leaves as will hold them, evenly filled, and the internal levels built
+// bottom-up once the leaves are done, each from the first keys of the level
+// below. Pages are written in one pass, leaves first and the root last, so
+// only a page and a key per leaf are held in memory.
+//
+// The file is written under a temporary name and renamed over `path` once
+// it is on disk, so a crash leaves either the old file or the new one.
+template <typename K, typename V, std::size_t PageBytes> class image_writer {
+  using layout = page_layout<K, V, PageBytes>;
+  using leaf_page = typename layout::leaf_page;
+  using internal_page = typename layout::internal_page;
+
+public:
+  // `entries` must be how many entries add will be called with.
+  image_writer(const std::string &path, std::size_t entries)
+      : _path(path), _temp_path(path + ".tmp"),
+        _file(_temp_path, PageBytes), _page(PageBytes), _entries(entries) {
+    // Left over from an earlier save that failed, maybe.
+    _file.truncate(0);
+    // Spread the entries evenly, so that the last leaf is not left nearly
+    // empty. An empty tree still has its (empty) root leaf.
+    _leaves = std::max<std::size_t>(
+        (entries + layout::leaf_capacity - 1) / layout::leaf_capacity, 1);
+    _firsts.reserve(_leaves);
+    start_leaf();
+  }
+
+  void add(const K &key, const V &value) {
+    auto leaf = reinterpret_cast<leaf_page *>(_page.data());
+    if (leaf->header.size == _leaf_size) {
+      finish_leaf();
+      start_leaf();
+    }
+    auto index = leaf->header.size++;
+    leaf->keys[index] = key;
+    leaf->values[index] = value;
+    if (index == 0) {
+      _firsts.push_back(key);
+    }
+  }
+
+  // Writes the internal levels and the header and moves the file into place.
+  void finish() {
+    finish_leaf();
+    std::vector<page_id> level(_leaves);
+    for (std::size_t i = 0; i < _leaves; ++i) {
+      level[i] = i + 1;
+    }
+    // _firsts[i] is the lowest key under level[i]; the first one is never
+    // needed as a separator, so an empty tree having none is fine.
+    _firsts.resize(_leaves);
+    while (level.size() > 1) {
+      level = write_level(level);
+    }
+
+    std::fill(_page.begin(), _page.end(), 0);
+    auto m = reinterpret_cast<typename layout::meta_page *>(_page.data());
+    layout::init(m);
+    m->root = level[0];
+    m->pages = _next_page;
+    m->entries = _entries;
+    _file.write(0, _page.data());
+    _file.sync();
+    if (std::rename(_temp_path.c_str(), _path.c_str()) != 0) {
+      throw_errno("rename " + _temp_path);
+    }
+  }
+
+private:
+  void start_leaf() {
+    std::fill(_page.begin(), _page.end(), 0);
+    auto leaf = reinterpret_cast<leaf_page *>(_page.data());
+    leaf->header.leaf = 1;
+    auto index = _next_page - 1;
+    leaf->header.prev = index ? _next_page - 1 : 0;
+    leaf->header.next = index + 1 < _leaves ? _next_page + 1 : 0;
+    _leaf_size = _entries / _leaves + (index < _entries % _leaves);
+  }
+
+  void finish_leaf() { _file.write(_next_page++, _page.data()); }
+
+  // Writes the internal pages above `children`, whose lowest keys are in
+  // _firsts, and returns them, leaving their lowest keys in _firsts.
+  std::vector<page_id> write_level(const std::vector<page_id> &children) {
+    auto fanout = layout::internal_capacity + 1;
+    auto count = (children.size() + fanout - 1) / fanout;
+    std::vector<page_id> parents;
+    std::vector<K> firsts;
+    std::size_t child = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+      auto size = children.size() / count + (i < children.size() % count);
+      std::fill(_page.begin(), _page.end(), 0);
+      auto in = reinterpret_cast<internal_page *>(_page.data());
+      in->header.size = size;
+      firsts.push_back(_firsts[child]);
+      for (std::size_t j = 0; j < size; ++j, ++child) {
+        in->children[j] = children[child];
+        if (j > 0) {
+          in->keys[j - 1] = _firsts[child];
+        }
+      }
+      parents.push_back(_next_page);
+      _file.write(_next_page++, _page.data());
+    }
+    _firsts = std::move(firsts);
+    return parents;
+  }
+
+  std::string _path;
+  std::string _temp_path;
+  page_file _file;
+  // The page being filled, as raw bytes so it can go straight to the file.
+  std::vector<char> _page;
+  std::size_t _entries;
+  std::size_t _leaves;
+  std::size_t _leaf_size = 0;
+  page_id _next_page = 1;
+  std::vector<K> _firsts;
+};
+
+} // namespace detail
+} // namespace amidvidy
@@ -0,0 +1,560 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "btree.hpp"
+#include "buffer_pool.hpp"
+#include "page_layout.hpp"
+
+namespace amidvidy {
+
+template <typename K, typename V, std::size_t PageBytes, typename Compare>
+class durable_btree;
+
+// A B+-tree whose nodes are fixed-size pages of a file rather than blocks
+// of the heap, for indexes that outgrow memory. Only as many pages as fit
+// in `cache_bytes` are kept in memory, in a buffer pool (see
+// detail::buffer_pool) between the tree and the file, and the others are
+// read in as descents reach them. Children are page numbers rather than
+// pointers, and pages have no parent links: an insert remembers the path it
+// came down and splits back up along it.
+//
+// The interface follows btree's: insert, lookup, find, lower_bound, scan,
+// erase and iteration, with entries of equal keys kept in insertion order.
+// Keys and values are stored as their bytes, so both must be trivially
+// copyable, and the file can only be opened again with the same key, value
+// and page sizes and a comparator that orders keys the same way. The format
+// is detail::page_layout's, so files written by btree::save open here too,
+// and mapped_btree can read these once they are flushed.
+//
+// Erase takes entries out of their leaf and leaves it at that, however few
+// are left, as most disk-based B-trees do: merging would cost extra page
+// writes on every erase, and inserts into the same key range reuse the
+// room. Changes reach the file when pages are evicted, on flush() and when
+// the tree is destroyed; a crash in between can leave the file torn. See
+// durable_btree for a tree that survives crashes.
+//
+// Not safe to use from several threads at once.
+template <typename K, typename V, std::size_t PageBytes = 4096,
+          typename Compare = std::less<K>>
+class paged_btree : private detail::compare_holder<Compare> {
+  using layout = detail::page_layout<K, V, PageBytes>;
+  using page_id = detail::page_id;
+  using page_ref = detail::page_ref;
+  using page_header = typename layout::page_header;
+  using meta_page = typename layout::meta_page;
+  using leaf_page = typename layout::leaf_page;
+  using internal_page = typename layout::internal_page;
+
+public:
+  using key_type = K;
+  using value_type = V;
+  using key_compare = Compare;
+  // Dereferencing an iterator gives the key and value in the pinned page.
+  using reference = std::tuple<const key_type &, const value_type &>;
+
+  static constexpr std::size_t page_bytes = PageBytes;
+
+  // Entries per leaf page.
+  static constexpr std::size_t leaf_capacity = layout::leaf_capacity;
+
+  // Keys per internal page, which has one more child than that.
+  static constexpr std::size_t internal_capacity = layout::internal_capacity;
+
+  // Forward only. Keeps the leaf it points into pinned.
+  class iterator;
+
+  // Opens the tree in the file at `path`, creating both if there is no such
+  // file. At most cache_bytes of pages are held in memory, though never
+  // fewer than min_cached_pages.
+  paged_btree(const std::string &path, std::size_t cache_bytes,
+              const Compare &comp = Compare());
+
+  // Writes everything back.
+  ~paged_btree();
+
+  paged_btree(const paged_btree &) = delete;
+  paged_btree &operator=(const paged_btree &) = delete;
+
+  // Adds an entry, after any others with the same key.
+  void insert(const key_type &key, const value_type &value);
+
+  // Copies the value of an entry with the key into `value`. Returns false,
+  // leaving `value` alone, if there is none.
+  bool lookup(const key_type &key, value_type &value);
+
+  // The first entry with exactly this key, or end().
+  iterator find(const key_type &key);
+
+  // The first entry with a key not less than this one.
+  iterator lower_bound(const key_type &key);
+
+  // Calls f(key, value) for every entry with lo <= key < hi, in order, and
+  // returns how many entries were visited; stops early if f returns false.
+  // Values are const here, since changing them would have to dirty every
+  // page the scan passes.
+  template <typename F>
+  std::size_t scan(const key_type &lo, const key_type &hi, F &&f);
+
+  // Removes every entry with the key and returns how many there were.
+  std::size_t erase(const key_type &key);
+
+  std::size_t size() const { return meta()->entries; }
+
+  bool empty() const { return size() == 0; }
+
+  iterator begin();
+  iterator end();
+
+  // Writes every changed page back and waits for the disk to have them.
+  void flush();
+
+  // Pages in the tree, the header page included, and how many of them fit
+  // in memory at once.
+  std::size_t pages() const { return meta()->pages; }
+  std::size_t cached_pages() const { return _pool.frames(); }
+
+  // An insert pins a page per level plus a few, so the pool never gets
+  // smaller than this.
+  static constexpr std::size_t min_cached_pages = 16;
+
+private:
+  friend class durable_btree<K, V, PageBytes, Compare>;
+
+  using key_search = detail::key_search<key_type, Compare, sizeof(key_type)>;
+
+  meta_page *meta() const { return _meta.template as<meta_page>(); }
+
+  static bool is_leaf(const page_ref &page) {
+    return page.template as<page_header>()->leaf;
+  }
+
+  // Adds a page to the end of the file, pinned and zeroed.
+  page_ref new_page(bool leaf);
+
+  // The leaf lower_bound(key) lands in. As in btree, entries equal to a
+  // separator can be on both sides of it, so this takes the child left of
+  // the first separator not less than the key.
+  page_ref find_leaf(const key_type &key);
+
+  // Puts the entry into a leaf that has room for it.
+  void insert_into(leaf_page *leaf, const key_type &key,
+                   const value_type &value);
+
+  // Adds `child` to an internal page with room for it, right after the
+  // child at `left`, with `key` separating the two.
+  static void insert_child(internal_page *in, std::size_t left,
+                           const key_type &key, page_id child);
+
+  // Pinned internal pages passed on the way down, each with the index of
+  // the child that was taken.
+  using path_type = std::vector<std::pair<page_ref, std::size_t>>;
+
+  // Adds a page split off the child at the end of the path to its parent,
+  // splitting upwards as needed.
+  void insert_split(path_type &path, key_type separator, page_id right);
+
+  // erase(key), calling between_leaves() whenever the run of equal keys
+  // goes on into the next leaf. The entries erased so far are counted in
+  // the header by then, so the pages make a whole tree at that point.
+  template <typename F>
+  std::size_t erase(const key_type &key, F &&between_leaves);
+
+  // Declared in this order so that the pages are unpinned and the pool is
+  // gone before the file is closed.
+  detail::page_file _file;
+  detail::buffer_pool _pool;
+  // The header page, pinned for the life of the tree.
+  page_ref _meta;
+  // Levels, the leaves included. An insert pins a page per level and
+  // dirties at most two per level, which durable_btree keeps room for.
+  std::size_t _height = 1;
+};
+
+template <typename K, typename V, std::size_t P, typename C>
+class paged_btree<K, V, P, C>::iterator
+    : public std::iterator<std::forward_iterator_tag, std::tuple<K, V>,
+                           std::ptrdiff_t, void, reference> {
+public:
+  iterator() = default;
+
+  reference operator*() const {
+    auto leaf = _page.template as<leaf_page>();
+    return reference(leaf->keys[_index], leaf->values[_index]);
+  }
+
+  iterator &operator++() {
+    ++_index;
+    settle();
+    return *this;
+  }
+
+  iterator operator++(int) {
+    auto before = *this;
+    ++*this;
+    return before;
+  }
+
+  friend bool operator==(const iterator &lhs, const iterator &rhs) {
+    return lhs._page.id() == rhs._page.id() && lhs._index == rhs._index;
+  }
+
+  friend bool operator!=(const iterator &lhs, const iterator &rhs) {
+    return !(lhs == rhs);
+  }
+
+private:
+  friend class paged_btree;
+
+  iterator(paged_btree *tree, page_ref page, std::size_t index)
+      : _tree(tree), _page(std::move(page)), _index(index) {
+    settle();
+  }
+
+  // Moves on from one past the end of a leaf, and from empty leaves, to the
+  // next entry, or to end() with no page pinned.
+  void settle() {
+    while (_page) {
+      auto header = _page.template as<page_header>();
+      if (_index < header->size) {
+        return;
+      }
+      if (!header->next) {
+        _page.reset();
+        _index = 0;
+        return;
+      }
+      _page = _tree->_pool.pin(header->next);
+      _index = 0;
+    }
+  }
+
+  paged_btree *_tree = nullptr;
+  page_ref _page;
+  std::size_t _index = 0;
+};
+
+template <typename K, typename V, std::size_t P, typename C>
+constexpr std::size_t paged_btree<K, V, P, C>::leaf_capacity;
+
+template <typename K, typename V, std::size_t P, typename C>
+constexpr std::size_t paged_btree<K, V, P, C>::internal_capacity;
+
+template <typename K, typename V, std::size_t P, typename C>
+constexpr std::size_t paged_btree<K, V, P, C>::page_bytes;
+
+template <typename K, typename V, std::size_t P, typename C>
+constexpr std::size_t paged_btree<K, V, P, C>::min_cached_pages;
+
+template <typename K, typename V, std::size_t P, typename C>
+paged_btree<K, V, P, C>::paged_btree(const std::string &path,
+                                     std::size_t cache_bytes, const C &comp)
+    : detail::compare_holder<C>(comp), _file(path, P),
+      _pool(_file, std::max(cache_bytes / P, min_cached_pages)) {
+  if (_file.pages() == 0) {
+    // A new file: the header and an empty root leaf.
+    _meta = _pool.pin_new(0);
+    auto m = meta();
+    layout::init(m);
+    m->pages = 1;
+    m->root = new_page(true).id();
+    return;
+  }
+  _meta = _pool.pin(0);
+  if (!layout::matches(meta())) {
+    throw std::runtime_error(
+        "paged_btree: " + path +
+        " is not a tree file with these key, value and page sizes");
+  }
+  for (auto page = _pool.pin(meta()->root); !is_leaf(page);
+       page = _pool.pin(page.template as<internal_page>()->children[0])) {
+    ++_height;
+  }
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+paged_btree<K, V, P, C>::~paged_btree() {
+  try {
+    flush();
+  } catch (...) {
+    // Nothing to be done about it here; call flush() first to find out.
+  }
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+auto paged_btree<K, V, P, C>::new_page(bool leaf) -> page_ref {
+  auto page = _pool.pin_new(meta()->pages++);
+  _meta.mark_dirty();
+  page.template as<page_header>()->leaf = leaf;
+  return page;
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+auto paged_btree<K, V, P, C>::find_leaf(const key_type &key) -> page_ref {
+  auto page = _pool.pin(meta()->root);
+  while (!is_leaf(page)) {
+    auto in = page.template as<internal_page>();
+    auto index = key_search::lower_bound(in->keys, in->header.size - 1, key,
+                                         this->compare());
+    page = _pool.pin(in->children[index]);
+  }
+  return page;
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+void paged_btree<K, V, P, C>::insert(const key_type &key,
+                                     const value_type &value) {
+  // Descend as btree's insert does, after any separators equal to the key.
+  path_type path;
+  auto page = _pool.pin(meta()->root);
+  while (!is_leaf(page)) {
+    auto in = page.template as<internal_page>();
+    auto index = key_search::upper_bound(in->keys, in->header.size - 1, key,
+                                         this->compare());
+    auto child = in->children[index];
+    path.emplace_back(std::move(page), index);
+    page = _pool.pin(child);
+  }
+
+  auto leaf = page.template as<leaf_page>();
+  page.mark_dirty();
+  if (leaf->header.size < leaf_capacity) {
+    insert_into(leaf, key, value);
+  } else {
+    // Split in half, linking the new leaf in after this one.
+    auto right_page = new_page(true);
+    auto right = right_page.template as<leaf_page>();
+    auto split = leaf_capacity / 2;
+    auto moved = leaf_capacity - split;
+    std::copy(leaf->keys + split, leaf->keys + leaf_capacity, right->keys);
+    std::copy(leaf->values + split, leaf->values + leaf_capacity,
+              right->values);
+    right->header.size = moved;
+    leaf->header.size = split;
+
+    right->header.next = leaf->header.next;
+    right->header.prev = page.id();
+    if (leaf->header.next) {
+      auto next = _pool.pin(leaf->header.next);
+      next.template as<page_header>()->prev = right_page.id();
+      next.mark_dirty();
+    }
+    leaf->header.next = right_page.id();
+
+    auto separator = right->keys[0];
+    insert_into(this->compare()(key, separator) ? leaf : right, key, value);
+    insert_split(path, separator, right_page.id());
+  }
+  ++meta()->entries;
+  _meta.mark_dirty();
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+void paged_btree<K, V, P, C>::insert_into(leaf_page *leaf,
+                                          const key_type &key,
+                                          const value_type &value) {
+  auto size = leaf->header.size;
+  auto index = key_search::upper_bound(leaf->keys, size, key, this->compare());
+  std::copy_backward(leaf->keys + index, leaf->keys + size,
+                     leaf->keys + size + 1);
+  std::copy_backward(leaf->values + index, leaf->values + size,
+                     leaf->values + size + 1);
+  leaf->keys[index] = key;
+  leaf->values[index] = value;
+  ++leaf->header.size;
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+void paged_btree<K, V, P, C>::insert_child(internal_page *in,
+                                           std::size_t left,
+                                           const key_type &key,
+                                           page_id child) {
+  auto size = in->header.size;
+  std::copy_backward(in->keys + left, in->keys + size - 1, in->keys + size);
+  std::copy_backward(in->children + left + 1, in->children + size,
+                     in->children + size + 1);
+  in->keys[left] = key;
+  in->children[left + 1] = child;
+  ++in->header.size;
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+void paged_btree<K, V, P, C>::insert_split(path_type &path,
+                                           key_type separator,
+                                           page_id right) {
+  for (; !path.empty(); path.pop_back()) {
+    auto &page = path.back().first;
+    auto left = path.back().second;
+    auto in = page.template as<internal_page>();
+    page.mark_dirty();
+    if (in->header.size < internal_capacity + 1) {
+      insert_child(in, left, separator, right);
+      return;
+    }
+
+    // Full: the children from the split point on move to a new page, and
+    // the separator in front of them moves up to our parent instead.
+    auto sibling_page = new_page(false);
+    auto sibling = sibling_page.template as<internal_page>();
+    std::size_t split = (internal_capacity + 1) / 2;
+    auto size = in->header.size;
+    std::copy(in->keys + split, in->keys + size - 1, sibling->keys);
+    std::copy(in->children + split, in->children + size, sibling->children);
+    sibling->header.size = size - split;
+    in->header.size = split;
+    auto up = in->keys[split - 1];
+
+    if (left < split) {
+      insert_child(in, left, separator, right);
+    } else {
+      insert_child(sibling, left - split, separator, right);
+    }
+    separator = up;
+    right = sibling_page.id();
+  }
+
+  // The root split, so the tree grows a level.
+  auto root_page = new_page(false);
+  auto root = root_page.template as<internal_page>();
+  root->keys[0] = separator;
+  root->children[0] = meta()->root;
+  root->children[1] = right;
+  root->header.size = 2;
+  meta()->root = root_page.id();
+  _meta.mark_dirty();
+  ++_height;
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+bool paged_btree<K, V, P, C>::lookup(const key_type &key, value_type &value) {
+  auto iter = find(key);
+  if (iter == end()) {
+    return false;
+  }
+  value = std::get<1>(*iter);
+  return true;
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+auto paged_btree<K, V, P, C>::find(const key_type &key) -> iterator {
+  auto iter = lower_bound(key);
+  if (iter != end() && this->compare()(key, std::get<0>(*iter))) {
+    return end();
+  }
+  return iter;
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+auto paged_btree<K, V, P, C>::lower_bound(const key_type &key) -> iterator {
+  auto page = find_leaf(key);
+  auto leaf = page.template as<leaf_page>();
+  auto index =
+      key_search::lower_bound(leaf->keys, leaf->header.size, key,
+                              this->compare());
+  return iterator(this, std::move(page), index);
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+template <typename F>
+std::size_t paged_btree<K, V, P, C>::scan(const key_type &lo,
+                                          const key_type &hi, F &&f) {
+  auto &comp = this->compare();
+  std::size_t count = 0;
+  auto page = find_leaf(lo);
+  auto leaf = page.template as<leaf_page>();
+  auto index =
+      key_search::lower_bound(leaf->keys, leaf->header.size, lo, comp);
+  for (;;) {
+    const key_type *keys = leaf->keys;
+    const value_type *values = leaf->values;
+    for (auto size = leaf->header.size; index < size; ++index) {
+      if (!comp(keys[index], hi)) {
+        return count;
+      }
+      ++count;
+      if (!detail::visit(f, keys[index], values[index])) {
+        return count;
+      }
+    }
+    if (!leaf->header.next) {
+      return count;
+    }
+    page = _pool.pin(leaf->header.next);
+    leaf = page.template as<leaf_page>();
+    index = 0;
+  }
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+std::size_t paged_btree<K, V, P, C>::erase(const key_type &key) {
+  return erase(key, [] {});
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+template <typename F>
+std::size_t paged_btree<K, V, P, C>::erase(const key_type &key,
+                                           F &&between_leaves) {
+  auto &comp = this->compare();
+  std::size_t count = 0;
+  auto page = find_leaf(key);
+  for (;;) {
+    auto leaf = page.template as<leaf_page>();
+    auto size = leaf->header.size;
+    auto first = key_search::lower_bound(leaf->keys, size, key, comp);
+    auto last = first;
+    while (last < size && !comp(key, leaf->keys[last])) {
+      ++last;
+    }
+    if (last > first) {
+      std::copy(leaf->keys + last, leaf->keys + size, leaf->keys + first);
+      std::copy(leaf->values + last, leaf->values + size,
+                leaf->values + first);
+      leaf->header.size = size - (last - first);
+      page.mark_dirty();
+      meta()->entries -= last - first;
+      _meta.mark_dirty();
+      count += last - first;
+    }
+    // A run of equal keys can go on in the next leaf only if it reached the
+    // end of this one.
+    if (last < size || !leaf->header.next) {
+      break;
+    }
+    auto next = leaf->header.next;
+    between_leaves();
+    page = _pool.pin(next);
+  }
+  return count;
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+auto paged_btree<K, V, P, C>::begin() -> iterator {
+  auto page = _pool.pin(meta()->root);
+  while (!is_leaf(page)) {
+    page = _pool.pin(page.template as<internal_page>()->children[0]);
+  }
+  return iterator(this, std::move(page), 0);
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+auto paged_btree<K, V, P, C>::end() -> iterator {
+  return iterator();
+}
+
+template <typename K, typename V, std::size_t P, typename C>
+void paged_btree<K, V, P, C>::flush() {
+  _pool.flush();
+  _file.sync();
+}
+
+} // namespace amidvidy
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace amidvidy {
+namespace detail {
+
+// Whether a T can be moved to another address by copying its bytes, with the
+// old copy then forgotten about rather than destroyed. That holds for all
+// trivially copyable types, and for most others that do not point into
+// themselves; specialize this for such types to have nodes shift them with
+// memmove.
+template <typename T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T> {};
+
+// A unique_ptr is just its pointer and its deleter.
+template <typename T, typename D>
+struct is_trivially_relocatable<std::unique_ptr<T, D>>
+    : is_trivially_relocatable<D> {};
+
+// Moves the objects in [first, last) to the uninitialized slots starting at
+// `dest` and ends their lifetime at the old address, leaving those slots
+// uninitialized. The ranges may overlap.
+template <typename T>
+std::enable_if_t<is_trivially_relocatable<T>::value>
+relocate(T *first, T *last, T *dest) {
+  if (first != last) {
+    std::memmove(static_cast<void *>(dest), static_cast<const void *>(first),
+                 (last - first) * sizeof(T));
+  }
+}
+
+template <typename T>
+std::enable_if_t<!is_trivially_relocatable<T>::value>
+relocate(T *first, T *last, T *dest) {
+  // Go in the direction that never constructs over a live object.
+  if (dest < first) {
+    for (; first != last; ++first, ++dest) {
+      new (dest) T(std::move(*first));
+      first->~T();
+    }
+  } else if (dest > first) {
+    for (dest += last - first; first != last;) {
+      new (--dest) T(std::move(*--last));
+      last->~T();
+    }
+  }
+}
+
+// Room for N objects of type T, none of which are constructed up front.
+// Nodes construct objects in the slots they fill and destroy them when they
+// are emptied, so a node costs nothing for its unused slots, and K and V need
+// not be default constructible. Which slots are live is up to the owner.
+template <typename T, std::size_t N> class slot_array {
+public:
+  slot_array() = default;
+
+  slot_array(const slot_array &) = delete;
+  slot_array &operator=(const slot_array &) = delete;
+
+  T *data() { return reinterpret_cast<T *>(_storage); }
+
+  const T *data() const { return reinterpret_cast<const T *>(_storage); }
+
+  T &operator[](std::size_t index) { return data()[index]; }
+
+  const T &operator[](std::size_t index) const { return data()[index]; }
+
+  template <typename... Args>
+  void construct(std::size_t index, Args &&... args) {
+    new (data() + index) T(std::forward<Args>(args)...);
+  }
+
+  void destroy(std::size_t index) { data()[index].~T(); }
+
+  void destroy(std::size_t first, std::size_t last) {
+    if (!std::is_trivially_destructible<T>::value) {
+      for (; first < last; ++first) {
+        destroy(first);
+      }
+    }
+  }
+
+private:
+  alignas(T) unsigned char _storage[sizeof(T) * N];
+};
+
+} // namespace detail
+} // namespace amidvidy
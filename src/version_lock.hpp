@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+namespace amidvidy {
+namespace detail {
+
+inline void cpu_relax() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  _mm_pause();
+#endif
+}
+
+// Called before retrying an optimistic operation. A short conflict clears up
+// by itself, but if the writer holding a lock was descheduled, spinning only
+// keeps it off the CPU for longer.
+inline void restart_backoff(unsigned attempt) {
+  if (attempt < 16) {
+    cpu_relax();
+  } else {
+    std::this_thread::yield();
+  }
+}
+
+// A version lock for optimistic lock coupling.
+//
+// Readers never write to the lock. They remember the version before looking
+// at a node and check it again afterwards; if it moved, what they read may be
+// torn and they start over. Writers take the lock by bumping the version to
+// an odd number and release it by bumping it again, so every modification
+// invalidates concurrent readers.
+class optimistic_lock {
+public:
+  std::uint64_t read_lock_or_restart(bool &restart) const {
+    auto version = _version.load(std::memory_order_acquire);
+    if (version & locked) {
+      restart = true;
+    }
+    return version;
+  }
+
+  // Checks that nothing changed since read_lock_or_restart returned the
+  // version. Reading through a node whose version still matches is safe.
+  void check_or_restart(std::uint64_t version, bool &restart) const {
+    read_unlock_or_restart(version, restart);
+  }
+
+  void read_unlock_or_restart(std::uint64_t version, bool &restart) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (_version.load(std::memory_order_relaxed) != version) {
+      restart = true;
+    }
+  }
+
+  // Turns a read of the given version into the write lock, failing if anyone
+  // wrote in between.
+  void upgrade_to_write_lock_or_restart(std::uint64_t &version,
+                                        bool &restart) {
+    if (!_version.compare_exchange_strong(version, version + locked,
+                                          std::memory_order_acquire)) {
+      restart = true;
+      return;
+    }
+    // Keep our writes from becoming visible before the odd version.
+    std::atomic_thread_fence(std::memory_order_release);
+    version += locked;
+  }
+
+  void write_unlock() { _version.fetch_add(locked, std::memory_order_release); }
+
+private:
+  static constexpr std::uint64_t locked = 1;
+
+  std::atomic<std::uint64_t> _version{0};
+};
+
+// Stands in for optimistic_lock when the tree is not shared between threads;
+// everything compiles away.
+class no_lock {
+public:
+  std::uint64_t read_lock_or_restart(bool &) const { return 0; }
+  void check_or_restart(std::uint64_t, bool &) const {}
+  void read_unlock_or_restart(std::uint64_t, bool &) const {}
+  void upgrade_to_write_lock_or_restart(std::uint64_t &, bool &) {}
+  void write_unlock() {}
+};
+
+} // namespace detail
+} // namespace amidvidy
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "buffer_pool.hpp"
+
+namespace amidvidy {
+namespace detail {
+
+// 32-bit FNV-1a, to tell a record that made it to disk whole from one that
+// a crash cut short or left half written.
+inline std::uint32_t checksum(const void *data, std::size_t bytes) {
+  auto p = static_cast<const unsigned char *>(data);
+  std::uint32_t hash = 2166136261u;
+  for (std::size_t i = 0; i < bytes; ++i) {
+    hash = (hash ^ p[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// An append-only file of records, each its length, its checksum and its
+// bytes. What is in the records is up to the user.
+//
+// Appended records collect in memory and reach the disk together, in one
+// write and one fdatasync, on commit: group commit, which makes the cost of
+// the sync per record a fraction of what it would be alone. commit is
+// called by itself every `group_commit` records, and by an append that
+// finds the oldest uncommitted record `max_delay` old, or can be called
+// sooner. There is no timer: when appends stop, the last group waits for
+// the next commit, and a crash before it loses the records since the last
+// one. Records are always lost from the end, never from the middle.
+class write_ahead_log {
+public:
+  using clock = std::chrono::steady_clock;
+
+  write_ahead_log(const std::string &path, std::size_t group_commit,
+                  clock::duration max_delay = clock::duration::max())
+      : _file(path), _group_commit(std::max<std::size_t>(group_commit, 1)),
+        _max_delay(max_delay), _end(_file.bytes()) {}
+
+  void append(const void *data, std::size_t bytes) {
+    record_header header{static_cast<std::uint32_t>(bytes),
+                         checksum(data, bytes)};
+    auto p = static_cast<const char *>(data);
+    _buffer.insert(_buffer.end(), reinterpret_cast<const char *>(&header),
+                   reinterpret_cast<const char *>(&header + 1));
+    _buffer.insert(_buffer.end(), p, p + bytes);
+    if (++_pending >= _group_commit || waited_too_long()) {
+      commit();
+    } else if (_buffer.size() >= max_buffer_bytes) {
+      // Out to the file, but not synced: only commit promises anything.
+      write_buffer();
+    }
+  }
+
+  // Waits for every record appended so far to reach the disk.
+  void commit() {
+    write_buffer();
+    if (_pending) {
+      _file.sync_data();
+      _pending = 0;
+    }
+  }
+
+  // Records appended since the last commit.
+  std::size_t pending() const { return _pending; }
+
+  // Bytes in the log, committed or not.
+  std::uint64_t bytes() const { return _end + _buffer.size(); }
+
+  // Calls f(data, bytes) for every record in the file, in order, up to the
+  // first one that is cut short or does not match its checksum, which is
+  // where a crash stopped the log. That one and everything after it is cut
+  // off, so that records appended afterwards follow the last good one. The
+  // whole log is read into memory first.
+  template <typename F> void replay(F &&f) {
+    commit();
+    std::vector<char> data(_end);
+    data.resize(_file.read_at(0, data.data(), data.size()));
+    std::size_t offset = 0;
+    while (data.size() - offset >= sizeof(record_header)) {
+      record_header header;
+      std::memcpy(&header, data.data() + offset, sizeof(header));
+      auto start = offset + sizeof(header);
+      if (header.bytes > data.size() - start ||
+          checksum(data.data() + start, header.bytes) != header.checksum) {
+        break;
+      }
+      f(static_cast<const void *>(data.data() + start),
+        static_cast<std::size_t>(header.bytes));
+      offset = start + header.bytes;
+    }
+    if (offset < _end) {
+      _file.truncate(offset);
+      _file.sync();
+      _end = offset;
+    }
+  }
+
+  // Empties the log, records not yet committed included.
+  void reset() {
+    _buffer.clear();
+    _pending = 0;
+    _file.truncate(0);
+    _file.sync();
+    _end = 0;
+  }
+
+private:
+  struct record_header {
+    std::uint32_t bytes;
+    std::uint32_t checksum;
+  };
+
+  static constexpr std::size_t max_buffer_bytes = 1 << 20;
+
+  // Whether the oldest uncommitted record has waited max_delay, the clock
+  // being read only when there is a limit.
+  bool waited_too_long() {
+    if (_max_delay == clock::duration::max()) {
+      return false;
+    }
+    auto now = clock::now();
+    if (_pending == 1) {
+      _oldest = now;
+    }
+    return now - _oldest >= _max_delay;
+  }
+
+  void write_buffer() {
+    if (!_buffer.empty()) {
+      _file.write_at(_end, _buffer.data(), _buffer.size());
+      _end += _buffer.size();
+      _buffer.clear();
+    }
+  }
+
+  file _file;
+  std::size_t _group_commit;
+  clock::duration _max_delay;
+  // When the first record since the last commit was appended.
+  clock::time_point _oldest;
+  // Where the next write goes: the end of what is in the file.
+  std::uint64_t _end;
+  std::vector<char> _buffer;
+  std::size_t _pending = 0;
+};
+
+} // namespace detail
+} // namespace amidvidy
@@ -0,0 +1,468 @@
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "catch.hpp"
+
+#include "btree.hpp"
+
+namespace {
+
+struct unique_policy : amidvidy::btree_policy {
+  static constexpr bool unique_keys = true;
+};
+
+struct checked_policy : amidvidy::btree_policy {
+  static constexpr bool checked_iterators = true;
+};
+
+struct sum_of_values {
+  using result_type = std::int64_t;
+  static result_type identity() { return 0; }
+  static result_type of(const std::int64_t &, const std::int64_t &value) {
+    return value;
+  }
+  static result_type combine(const result_type &a, const result_type &b) {
+    return a + b;
+  }
+};
+
+struct statistics_policy : amidvidy::btree_policy {
+  static constexpr bool order_statistics = true;
+  using aggregate = sum_of_values;
+};
+
+// Small nodes, so that a few hundred entries make a tree several levels
+// deep and every erase has siblings to borrow from or merge with.
+using small_tree = amidvidy::btree<std::int64_t, std::int64_t, 4>;
+using unique_tree = amidvidy::btree<std::int64_t, std::int64_t, 4,
+                                    std::less<std::int64_t>, unique_policy>;
+using statistics_tree =
+    amidvidy::btree<std::int64_t, std::int64_t, 4, std::less<std::int64_t>,
+                    statistics_policy>;
+
+// Checks that the tree holds the map's entries in the map's order, walking
+// it both ways.
+template <typename Tree, typename Map>
+void check_same(Tree &bt, const Map &expected) {
+  REQUIRE(bt.size() == expected.size());
+  REQUIRE(bt.empty() == expected.empty());
+  auto it = expected.begin();
+  for (auto entry : bt) {
+    REQUIRE(it != expected.end());
+    REQUIRE(std::get<0>(entry) == it->first);
+    REQUIRE(std::get<1>(entry) == it->second);
+    ++it;
+  }
+  REQUIRE(it == expected.end());
+  auto rit = expected.rbegin();
+  for (auto r = bt.rbegin(); r != bt.rend(); ++r, ++rit) {
+    REQUIRE(std::get<0>(*r) == rit->first);
+    REQUIRE(std::get<1>(*r) == rit->second);
+  }
+  REQUIRE(rit == expected.rend());
+}
+
+// A key that sorts as its number does, and is too long for the small
+// string buffer, so that a destroyed one shows.
+std::string key_text(std::int64_t n) {
+  auto digits = std::to_string(n);
+  return std::string(40 - digits.size(), '0') + digits;
+}
+
+// Goes over the entries (key_text(i / 2), i), every key twice, and returns
+// them by value, as a generating iterator would.
+class generated_iterator {
+public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = std::tuple<std::string, std::int64_t>;
+  using difference_type = std::ptrdiff_t;
+  using pointer = void;
+  using reference = value_type;
+
+  explicit generated_iterator(std::int64_t i) : _i(i) {}
+
+  value_type operator*() const { return value_type(key_text(_i / 2), _i); }
+  generated_iterator &operator++() {
+    ++_i;
+    return *this;
+  }
+  generated_iterator operator++(int) {
+    auto old = *this;
+    ++_i;
+    return old;
+  }
+  bool operator==(const generated_iterator &other) const {
+    return _i == other._i;
+  }
+  bool operator!=(const generated_iterator &other) const {
+    return _i != other._i;
+  }
+
+private:
+  std::int64_t _i;
+};
+
+} // namespace
+
+TEST_CASE("insert keeps duplicates in insertion order", "[btree]") {
+  small_tree bt;
+  std::multimap<std::int64_t, std::int64_t> expected;
+  std::mt19937_64 rng(1);
+  for (std::int64_t i = 0; i < 2000; ++i) {
+    auto key = static_cast<std::int64_t>(rng() % 300);
+    auto iter = bt.insert(key, i);
+    REQUIRE(std::get<0>(*iter) == key);
+    REQUIRE(std::get<1>(*iter) == i);
+    expected.emplace(key, i);
+  }
+  check_same(bt, expected);
+
+  for (std::int64_t key = -1; key <= 301; ++key) {
+    auto range = bt.equal_range(key);
+    auto expected_range = expected.equal_range(key);
+    REQUIRE(std::distance(range.first, range.second) ==
+            std::distance(expected_range.first, expected_range.second));
+    auto lower = expected.lower_bound(key);
+    auto found = bt.lower_bound(key);
+    REQUIRE((found == bt.end()) == (lower == expected.end()));
+    if (lower != expected.end()) {
+      REQUIRE(std::get<1>(*found) == lower->second);
+    }
+    std::int64_t value = -1;
+    REQUIRE(bt.lookup(key, value) == (expected.count(key) != 0));
+  }
+}
+
+TEST_CASE("lookup finds what is left of a run spanning leaves", "[btree]") {
+  for (float min_fill : {0.0f, 0.5f}) {
+    small_tree bt;
+    bt.set_min_fill(min_fill);
+    for (std::int64_t i = 0; i < 100; ++i) {
+      bt.insert(i, i);
+    }
+    for (std::int64_t i = 0; i < 30; ++i) {
+      bt.insert(50, 1000 + i);
+    }
+    // Erase the copies from the back, which takes those right of the
+    // separators first.
+    for (std::int64_t left = 31; left > 0; --left) {
+      std::int64_t value = -1;
+      REQUIRE(bt.lookup(50, value));
+      REQUIRE(std::get<0>(*bt.find(50)) == 50);
+      REQUIRE(std::distance(bt.find(50), bt.find(51)) == left);
+      bt.erase(std::prev(bt.find(51)));
+    }
+    std::int64_t value = -1;
+    REQUIRE_FALSE(bt.lookup(50, value));
+    REQUIRE(bt.find(50) == bt.end());
+  }
+}
+
+TEST_CASE("emplace constructs the value in place", "[btree]") {
+  amidvidy::btree<std::int64_t, std::unique_ptr<std::string>, 4> bt;
+  std::multimap<std::int64_t, std::string> expected;
+  for (std::int64_t i = 0; i < 500; ++i) {
+    auto key = (i * 37) % 101;
+    auto text = std::to_string(i);
+    bt.emplace(key, new std::string(text));
+    expected.emplace(key, text);
+  }
+  REQUIRE(bt.size() == expected.size());
+  auto it = expected.begin();
+  for (auto entry : bt) {
+    REQUIRE(it != expected.end());
+    REQUIRE(std::get<0>(entry) == it->first);
+    REQUIRE(*std::get<1>(entry) == it->second);
+    ++it;
+  }
+  REQUIRE(it == expected.end());
+}
+
+TEST_CASE("insert takes a key and value read from the tree", "[btree]") {
+  // Enough copies that the leaf they go into splits, moving the entry the
+  // arguments refer to.
+  SECTION("trivially copyable") {
+    small_tree bt;
+    for (std::int64_t i = 0; i < 20; ++i) {
+      bt.insert(i, i * 100);
+    }
+    for (int i = 0; i < 50; ++i) {
+      bt.insert(5, std::get<1>(*bt.find(9)));
+      bt.insert(std::get<0>(*bt.find(7)), 700);
+    }
+    std::vector<std::int64_t> values;
+    for (auto range = bt.equal_range(5); range.first != range.second;
+         ++range.first) {
+      values.push_back(std::get<1>(*range.first));
+    }
+    std::vector<std::int64_t> inserted(50, 900);
+    inserted.insert(inserted.begin(), 500);
+    REQUIRE(values == inserted);
+    REQUIRE(std::distance(bt.find(7), bt.find(8)) == 51);
+  }
+
+  SECTION("strings") {
+    amidvidy::btree<std::string, std::string, 4> bt;
+    std::multimap<std::string, std::string> expected;
+    // Too long for the small string buffer, so a moved-from or destroyed
+    // string would show.
+    auto text = [](int i) { return std::string(40, 'a' + i); };
+    for (int i = 0; i < 20; ++i) {
+      bt.insert(text(i), text(i));
+      expected.emplace(text(i), text(i));
+    }
+    for (int i = 0; i < 50; ++i) {
+      auto iter = bt.find(text(i % 20));
+      bt.insert(std::get<0>(*iter), std::get<1>(*iter));
+      bt.emplace(text(5), std::get<1>(*bt.find(text(9))));
+      expected.emplace(text(i % 20), text(i % 20));
+      expected.emplace(text(5), text(9));
+    }
+    check_same(bt, expected);
+  }
+}
+
+TEST_CASE("try_emplace and insert_or_assign follow std::map", "[btree]") {
+  std::map<std::int64_t, std::int64_t> expected;
+  std::mt19937_64 rng(2);
+
+  SECTION("with unique keys") {
+    unique_tree bt;
+    for (std::int64_t i = 0; i < 3000; ++i) {
+      auto key = static_cast<std::int64_t>(rng() % 500);
+      switch (rng() % 4) {
+      case 0: {
+        auto result = bt.insert(key, i);
+        auto expected_result = expected.emplace(key, i);
+        REQUIRE(result.second == expected_result.second);
+        REQUIRE(std::get<1>(*result.first) == expected_result.first->second);
+        break;
+      }
+      case 1: {
+        auto result = bt.try_emplace(key, i);
+        auto expected_result = expected.emplace(key, i);
+        REQUIRE(result.second == expected_result.second);
+        break;
+      }
+      case 2: {
+        auto result = bt.insert_or_assign(key, i);
+        REQUIRE(result.second == (expected.count(key) == 0));
+        expected[key] = i;
+        REQUIRE(std::get<1>(*result.first) == i);
+        break;
+      }
+      default: {
+        auto result = bt.upsert(key, [](std::int64_t &value) { value += 7; });
+        REQUIRE(result.second == (expected.count(key) == 0));
+        expected[key] += 7;
+        break;
+      }
+      }
+    }
+    check_same(bt, expected);
+  }
+
+  SECTION("with duplicate keys allowed") {
+    small_tree bt;
+    for (std::int64_t i = 0; i < 3000; ++i) {
+      auto key = static_cast<std::int64_t>(rng() % 500);
+      if (rng() % 2) {
+        auto result = bt.try_emplace(key, i);
+        auto expected_result = expected.emplace(key, i);
+        REQUIRE(result.second == expected_result.second);
+      } else {
+        bt.insert_or_assign(key, i);
+        expected[key] = i;
+      }
+    }
+    check_same(bt, expected);
+  }
+}
+
+TEST_CASE("erase borrows from and merges with siblings", "[btree]") {
+  std::mt19937_64 rng(3);
+  for (float min_fill : {0.0f, 0.25f, 0.5f}) {
+    small_tree bt;
+    bt.set_min_fill(min_fill);
+    std::multimap<std::int64_t, std::int64_t> expected;
+    for (std::int64_t i = 0; i < 3000; ++i) {
+      auto key = static_cast<std::int64_t>(rng() % 1000);
+      bt.insert(key, i);
+      expected.emplace(key, i);
+    }
+
+    // Erase by key, by position and by range until nothing is left, so
+    // that leaves and internal nodes underflow at every level.
+    while (!expected.empty()) {
+      auto key = static_cast<std::int64_t>(rng() % 1000);
+      switch (rng() % 3) {
+      case 0:
+        REQUIRE(bt.erase(key) == expected.erase(key));
+        break;
+      case 1: {
+        auto pos = bt.lower_bound(key);
+        auto expected_pos = expected.lower_bound(key);
+        if (expected_pos == expected.end()) {
+          REQUIRE(pos == bt.end());
+          break;
+        }
+        auto next = bt.erase(pos);
+        auto expected_next = expected.erase(expected_pos);
+        REQUIRE((next == bt.end()) == (expected_next == expected.end()));
+        if (expected_next != expected.end()) {
+          REQUIRE(std::get<1>(*next) == expected_next->second);
+        }
+        break;
+      }
+      default: {
+        auto first = bt.lower_bound(key);
+        auto last = bt.lower_bound(key + 20);
+        bt.erase(first, last);
+        expected.erase(expected.lower_bound(key),
+                       expected.lower_bound(key + 20));
+        break;
+      }
+      }
+      REQUIRE(bt.size() == expected.size());
+    }
+    check_same(bt, expected);
+
+    // The emptied tree takes inserts again.
+    for (std::int64_t i = 0; i < 100; ++i) {
+      bt.insert(i, i);
+      expected.emplace(i, i);
+    }
+    check_same(bt, expected);
+  }
+}
+
+TEST_CASE("rank, select, count and aggregate match brute force",
+          "[btree][statistics]") {
+  statistics_tree bt;
+  std::multimap<std::int64_t, std::int64_t> expected;
+  std::mt19937_64 rng(4);
+  for (std::int64_t i = 0; i < 2000; ++i) {
+    auto key = static_cast<std::int64_t>(rng() % 400);
+    auto value = static_cast<std::int64_t>(rng() % 1000);
+    bt.insert(key, value);
+    expected.emplace(key, value);
+  }
+  for (std::int64_t key = 0; key < 400; key += 3) {
+    expected.erase(key);
+    bt.erase(key);
+  }
+  check_same(bt, expected);
+
+  std::vector<std::pair<std::int64_t, std::int64_t>> entries(expected.begin(),
+                                                             expected.end());
+  auto brute_rank = [&](std::int64_t key) {
+    return static_cast<std::size_t>(
+        std::distance(expected.begin(), expected.lower_bound(key)));
+  };
+  for (std::int64_t key = -1; key <= 401; ++key) {
+    REQUIRE(bt.rank(key) == brute_rank(key));
+  }
+  for (std::size_t i = 0; i < entries.size(); ++i) {
+    auto iter = bt.select(i);
+    REQUIRE(std::get<0>(*iter) == entries[i].first);
+    REQUIRE(std::get<1>(*iter) == entries[i].second);
+  }
+  REQUIRE(bt.select(entries.size()) == bt.end());
+
+  for (int i = 0; i < 500; ++i) {
+    auto lo = static_cast<std::int64_t>(rng() % 420) - 10;
+    auto hi = static_cast<std::int64_t>(rng() % 420) - 10;
+    std::size_t count = 0;
+    std::int64_t sum = 0;
+    for (auto &entry : entries) {
+      if (lo <= entry.first && entry.first < hi) {
+        ++count;
+        sum += entry.second;
+      }
+    }
+    REQUIRE(bt.count(lo, hi) == count);
+    REQUIRE(bt.aggregate(lo, hi) == sum);
+  }
+
+  // Values changed in place count once refreshed.
+  auto iter = bt.find(entries[0].first);
+  std::get<1>(*iter) += 1000;
+  bt.refresh(iter);
+  std::int64_t total = 1000;
+  for (auto &entry : entries) {
+    total += entry.second;
+  }
+  REQUIRE(bt.aggregate(-1, 401) == total);
+}
+
+TEST_CASE("bulk_load and insert_batch agree with separate inserts",
+          "[btree]") {
+  std::mt19937_64 rng(5);
+  std::vector<std::pair<std::int64_t, std::int64_t>> items;
+  for (std::int64_t i = 0; i < 3000; ++i) {
+    items.emplace_back(static_cast<std::int64_t>(rng() % 1000), i);
+  }
+  std::multimap<std::int64_t, std::int64_t> expected(items.begin(),
+                                                     items.end());
+
+  small_tree batched;
+  REQUIRE(batched.insert_batch(items.begin(), items.end()) == items.size());
+  check_same(batched, expected);
+
+  small_tree loaded(expected.begin(), expected.end(), 0.7f);
+  check_same(loaded, expected);
+  for (auto &item : items) {
+    loaded.insert(item.first, item.second);
+    expected.emplace(item.first, item.second);
+  }
+  check_same(loaded, expected);
+}
+
+TEST_CASE("insert_batch takes iterators that return entries by value",
+          "[btree]") {
+  amidvidy::btree<std::string, std::int64_t, 4> bt;
+  REQUIRE(bt.insert_batch(generated_iterator(0), generated_iterator(400)) ==
+          400);
+  std::multimap<std::string, std::int64_t> expected;
+  for (std::int64_t i = 0; i < 400; ++i) {
+    expected.emplace(key_text(i / 2), i);
+  }
+  check_same(bt, expected);
+
+  // With unique keys, only the first of each pair goes in.
+  amidvidy::btree<std::string, std::int64_t, 4, std::less<std::string>,
+                  unique_policy>
+      unique;
+  unique.insert(key_text(7), -1);
+  REQUIRE(unique.insert_batch(generated_iterator(0),
+                              generated_iterator(400)) == 199);
+  std::map<std::string, std::int64_t> unique_expected;
+  for (std::int64_t i = 0; i < 200; ++i) {
+    unique_expected.emplace(key_text(i), i == 7 ? -1 : 2 * i);
+  }
+  check_same(unique, unique_expected);
+}
+
+TEST_CASE("checked iterators throw past either end", "[btree]") {
+  amidvidy::btree<std::int64_t, std::int64_t, 4, std::less<std::int64_t>,
+                  checked_policy>
+      bt;
+  REQUIRE_THROWS_AS(*bt.begin(), std::out_of_range);
+  for (std::int64_t i = 0; i < 20; ++i) {
+    bt.insert(i, i);
+  }
+  auto end = bt.end();
+  REQUIRE_THROWS_AS(*end, std::out_of_range);
+  REQUIRE_THROWS_AS(++end, std::out_of_range);
+  REQUIRE(std::get<0>(*--end) == 19);
+  auto begin = bt.begin();
+  REQUIRE_THROWS_AS(--begin, std::out_of_range);
+}
@@ -0,0 +1,159 @@
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <tuple>
+#include <unordered_set>
+#include <vector>
+
+#include "catch.hpp"
+
+#include "btree.hpp"
+
+// Stress tests for concurrent mode. Build them with -fsanitize=address to
+// catch a reader following a pointer into a node being split. ThreadSanitizer
+// reports the optimistic reads themselves, which race with writers by design
+// and are thrown away when the version moved.
+
+namespace {
+
+struct concurrent_policy : amidvidy::btree_policy {
+  static constexpr bool concurrent = true;
+};
+
+struct concurrent_unique_policy : concurrent_policy {
+  static constexpr bool unique_keys = true;
+};
+
+// Small nodes, so that the threads split nodes under each other all the
+// time.
+using concurrent_tree = amidvidy::btree<std::int64_t, std::int64_t, 8,
+                                        std::less<std::int64_t>,
+                                        concurrent_policy>;
+using concurrent_unique_tree =
+    amidvidy::btree<std::int64_t, std::int64_t, 8, std::less<std::int64_t>,
+                    concurrent_unique_policy>;
+
+constexpr int thread_count = 8;
+
+// Every entry with a key has the same value, so that a lookup can tell a
+// torn read from any of the duplicates.
+std::int64_t value_for(std::int64_t key) { return key * 3 + 1; }
+
+template <typename F> void run_threads(F f) {
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_count; ++t) {
+    threads.emplace_back(f, t);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+} // namespace
+
+TEST_CASE("concurrent inserts and lookups match a locked multimap",
+          "[concurrent]") {
+  concurrent_tree bt;
+  std::multimap<std::int64_t, std::int64_t> expected;
+  std::mutex expected_mutex;
+  // Failures are counted rather than checked in the threads, since Catch
+  // assertions are not thread safe.
+  std::vector<int> failures(thread_count);
+
+  run_threads([&](int t) {
+    std::mt19937_64 rng(t);
+    std::vector<std::int64_t> mine;
+    std::unordered_set<std::int64_t> inserted;
+    for (int i = 0; i < 20000; ++i) {
+      auto key = static_cast<std::int64_t>(rng() % 50000);
+      if (rng() % 4 == 0) {
+        bt.insert(key, value_for(key));
+        {
+          std::lock_guard<std::mutex> lock(expected_mutex);
+          expected.emplace(key, value_for(key));
+        }
+        mine.push_back(key);
+        inserted.insert(key);
+        continue;
+      }
+      // Keys this thread inserted must be found; any other key is either
+      // missing or has its value.
+      if (!mine.empty() && rng() % 2) {
+        key = mine[rng() % mine.size()];
+      }
+      std::int64_t value = -1;
+      bool found = bt.lookup(key, value);
+      if ((inserted.count(key) && !found) ||
+          (found && value != value_for(key))) {
+        ++failures[t];
+      }
+    }
+  });
+
+  for (int t = 0; t < thread_count; ++t) {
+    REQUIRE(failures[t] == 0);
+  }
+  REQUIRE(bt.size() == expected.size());
+  auto it = expected.begin();
+  for (auto entry : bt) {
+    REQUIRE(std::get<0>(entry) == it->first);
+    REQUIRE(std::get<1>(entry) == it->second);
+    ++it;
+  }
+}
+
+TEST_CASE("concurrent upserts on shared keys add up", "[concurrent]") {
+  concurrent_unique_tree bt;
+  std::map<std::int64_t, std::int64_t> expected;
+  std::mutex expected_mutex;
+
+  run_threads([&](int t) {
+    std::mt19937_64 rng(100 + t);
+    for (int i = 0; i < 20000; ++i) {
+      // Few enough keys that threads keep hitting the same entries.
+      auto key = static_cast<std::int64_t>(rng() % 2000);
+      auto amount = static_cast<std::int64_t>(rng() % 10);
+      bt.upsert(key, [&](std::int64_t &value) { value += amount; });
+      std::lock_guard<std::mutex> lock(expected_mutex);
+      expected[key] += amount;
+    }
+  });
+
+  REQUIRE(bt.size() == expected.size());
+  auto it = expected.begin();
+  for (auto entry : bt) {
+    REQUIRE(std::get<0>(entry) == it->first);
+    REQUIRE(std::get<1>(entry) == it->second);
+    ++it;
+  }
+}
+
+TEST_CASE("concurrent try_emplace finds a key ending the previous leaf",
+          "[concurrent]") {
+  concurrent_tree bt;
+  bt.set_min_fill(0);
+  // Eight entries with key 5 fill a leaf, and a 6 splits off the last of
+  // them with it. Erasing that 5 leaves the run of 5s entirely in the
+  // first leaf, while a descent for 5 still ends in the second.
+  for (std::int64_t i = 0; i < 8; ++i) {
+    bt.insert(5, i);
+  }
+  bt.insert(6, 0);
+  auto last_five = bt.begin();
+  std::advance(last_five, 7);
+  bt.erase(last_five);
+
+  auto result = bt.try_emplace(5, 100);
+  REQUIRE_FALSE(result.second);
+  REQUIRE(std::get<0>(*result.first) == 5);
+  REQUIRE(bt.size() == 8);
+
+  // The last of the 5s is the one assigned to.
+  auto assigned = bt.insert_or_assign(5, 100);
+  REQUIRE_FALSE(assigned.second);
+  REQUIRE(std::get<1>(*assigned.first) == 100);
+  REQUIRE(std::get<1>(*bt.find(5)) == 0);
+  REQUIRE(bt.size() == 8);
+}
@@ -0,0 +1,217 @@
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <tuple>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "catch.hpp"
+
+#include "durable_btree.hpp"
+
+// Crashes are simulated with fork: the child makes its changes and leaves
+// with _exit, which runs no destructors, so the tree is never checkpointed
+// or flushed and the files hold only what had reached them by then.
+
+namespace {
+
+// Small pages, so that a few thousand entries need far more pages than the
+// smallest pool holds and checkpoints come often.
+constexpr std::size_t page_bytes = 256;
+
+using durable_tree = amidvidy::durable_btree<std::int64_t, std::int64_t,
+                                             page_bytes>;
+
+// The tree file, its log and its journal, removed when it goes.
+class temp_tree {
+public:
+  explicit temp_tree(std::string path) : _path(std::move(path)) { remove(); }
+  ~temp_tree() { remove(); }
+
+  const std::string &path() const { return _path; }
+
+private:
+  void remove() {
+    for (auto suffix : {"", ".wal", ".journal"}) {
+      std::remove((_path + suffix).c_str());
+    }
+  }
+
+  std::string _path;
+};
+
+// Runs f in a child process that then dies without cleaning up, and
+// returns whether f got to the end.
+template <typename F> bool crash_after(F f) {
+  auto pid = fork();
+  if (pid == 0) {
+    try {
+      f();
+    } catch (...) {
+      _exit(1);
+    }
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+template <typename Map>
+void check_same(durable_tree &tree, const Map &expected) {
+  REQUIRE(tree.size() == expected.size());
+  auto it = expected.begin();
+  for (auto iter = tree.begin(); iter != tree.end(); ++iter, ++it) {
+    REQUIRE(it != expected.end());
+    REQUIRE(std::get<0>(*iter) == it->first);
+    REQUIRE(std::get<1>(*iter) == it->second);
+  }
+  REQUIRE(it == expected.end());
+}
+
+// The changes the children make, on the tree or on the map.
+template <typename Tree> void random_changes(Tree &tree, int seed) {
+  std::mt19937_64 rng(seed);
+  for (std::int64_t i = 0; i < 3000; ++i) {
+    auto key = static_cast<std::int64_t>(rng() % 500);
+    if (rng() % 8 == 0) {
+      tree.erase(key);
+    } else {
+      tree.insert(key, i);
+    }
+  }
+}
+
+struct map_changes {
+  void insert(std::int64_t key, std::int64_t value) {
+    map.emplace(key, value);
+  }
+  void erase(std::int64_t key) { map.erase(key); }
+
+  std::multimap<std::int64_t, std::int64_t> map;
+};
+
+} // namespace
+
+TEST_CASE("durable_btree keeps committed changes through a crash",
+          "[durable]") {
+  temp_tree file("btree_test.durable");
+  amidvidy::durability_options options;
+  options.group_commit = 16;
+  REQUIRE(crash_after([&] {
+    durable_tree tree(file.path(), 0, options);
+    random_changes(tree, 1);
+    tree.commit();
+  }));
+
+  map_changes expected;
+  random_changes(expected, 1);
+  {
+    durable_tree tree(file.path(), 0, options);
+    check_same(tree, expected.map);
+    random_changes(tree, 2);
+  }
+  random_changes(expected, 2);
+  durable_tree tree(file.path(), 0, options);
+  check_same(tree, expected.map);
+}
+
+TEST_CASE("durable_btree loses only changes after the last commit",
+          "[durable]") {
+  temp_tree file("btree_test.uncommitted");
+  amidvidy::durability_options options;
+  options.group_commit = 1 << 20;
+  REQUIRE(crash_after([&] {
+    durable_tree tree(file.path(), 0, options);
+    for (std::int64_t i = 0; i < 2000; ++i) {
+      tree.insert(i, -i);
+    }
+    tree.commit();
+    for (std::int64_t i = 2000; i < 3000; ++i) {
+      tree.insert(i, -i);
+    }
+  }));
+
+  // Checkpoints commit too, so some of the later inserts can be there, but
+  // only ever in order.
+  durable_tree tree(file.path(), 0, options);
+  REQUIRE(tree.size() >= 2000);
+  std::int64_t i = 0;
+  for (auto iter = tree.begin(); iter != tree.end(); ++iter, ++i) {
+    REQUIRE(std::get<0>(*iter) == i);
+    REQUIRE(std::get<1>(*iter) == -i);
+  }
+  REQUIRE(static_cast<std::size_t>(i) == tree.size());
+}
+
+TEST_CASE("durable_btree syncs a group that waited group_commit_delay",
+          "[durable]") {
+  temp_tree file("btree_test.delay");
+  amidvidy::durability_options options;
+  options.group_commit = 1 << 20;
+  options.group_commit_delay = std::chrono::milliseconds(0);
+  REQUIRE(crash_after([&] {
+    durable_tree tree(file.path(), 0, options);
+    for (std::int64_t i = 0; i < 100; ++i) {
+      tree.insert(i, -i);
+    }
+  }));
+  durable_tree tree(file.path(), 0, options);
+  REQUIRE(tree.size() == 100);
+}
+
+TEST_CASE("durable_btree erases more duplicates than the pool holds",
+          "[durable]") {
+  temp_tree file("btree_test.duplicates");
+  // Enough 5s for their leaves to outnumber the smallest pool several
+  // times over, between other keys.
+  std::multimap<std::int64_t, std::int64_t> expected;
+  auto fill = [&](durable_tree &tree) {
+    for (std::int64_t i = 0; i < 2000; ++i) {
+      tree.insert(5, i);
+    }
+    for (std::int64_t key = 0; key < 10; ++key) {
+      tree.insert(key, -key);
+    }
+    tree.checkpoint();
+  };
+  for (std::int64_t key = 0; key < 10; ++key) {
+    if (key != 5) {
+      expected.emplace(key, -key);
+    }
+  }
+
+  SECTION("and checkpoints it") {
+    {
+      durable_tree tree(file.path(), 0);
+      fill(tree);
+      REQUIRE(tree.erase(5) == 2001);
+      check_same(tree, expected);
+    }
+    durable_tree tree(file.path(), 0);
+    check_same(tree, expected);
+  }
+
+  SECTION("and replays it after a crash") {
+    amidvidy::durability_options options;
+    options.group_commit = 1;
+    // The erase writes pages part way through, then the crash comes before
+    // the checkpoint after it.
+    REQUIRE(crash_after([&] {
+      durable_tree tree(file.path(), 0, options);
+      fill(tree);
+      tree.erase(5);
+    }));
+    {
+      durable_tree tree(file.path(), 0, options);
+      check_same(tree, expected);
+    }
+    durable_tree tree(file.path(), 1 << 20, options);
+    check_same(tree, expected);
+  }
+}
@@ -0,0 +1,12 @@
+// Unit tests for the btree and its on-disk variants, built on Catch. Each
+// checks the tree against std::multimap or std::map, or against a brute
+// force count over the same entries.
+//
+// Build with something like:
+//   g++ -std=c++14 -O1 -g -pthread -Isrc -Ilib -o btree_test test/*.cpp
+//
+// and run ./btree_test, or ./btree_test '[paged]' for one group of tests.
+// The on-disk tests create and remove files in the working directory.
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
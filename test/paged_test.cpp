@@ -0,0 +1,203 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <tuple>
+
+#include "catch.hpp"
+
+#include "btree.hpp"
+#include "mapped_btree.hpp"
+#include "paged_btree.hpp"
+
+namespace {
+
+// Small pages, so that a few thousand entries fill a tree several levels
+// deep, and a cache of a few pages, so that most of them get evicted and
+// read back in.
+constexpr std::size_t page_bytes = 256;
+constexpr std::size_t cache_bytes = 16 * page_bytes;
+
+using paged_tree = amidvidy::paged_btree<std::int64_t, std::int64_t,
+                                         page_bytes>;
+using mapped_tree = amidvidy::mapped_btree<std::int64_t, std::int64_t,
+                                           page_bytes>;
+
+// A file name for the test, removed when it goes.
+class temp_file {
+public:
+  explicit temp_file(std::string path) : _path(std::move(path)) {
+    std::remove(_path.c_str());
+  }
+  ~temp_file() { std::remove(_path.c_str()); }
+
+  const std::string &path() const { return _path; }
+
+private:
+  std::string _path;
+};
+
+template <typename Tree, typename Map>
+void check_same(Tree &tree, const Map &expected) {
+  REQUIRE(tree.size() == expected.size());
+  auto it = expected.begin();
+  for (auto iter = tree.begin(); iter != tree.end(); ++iter, ++it) {
+    REQUIRE(it != expected.end());
+    REQUIRE(std::get<0>(*iter) == it->first);
+    REQUIRE(std::get<1>(*iter) == it->second);
+  }
+  REQUIRE(it == expected.end());
+}
+
+} // namespace
+
+TEST_CASE("paged_btree keeps its entries across reopening", "[paged]") {
+  temp_file file("btree_test.paged");
+  std::multimap<std::int64_t, std::int64_t> expected;
+  std::mt19937_64 rng(1);
+  {
+    paged_tree tree(file.path(), cache_bytes);
+    for (std::int64_t i = 0; i < 5000; ++i) {
+      auto key = static_cast<std::int64_t>(rng() % 1500);
+      tree.insert(key, i);
+      expected.emplace(key, i);
+    }
+    for (std::int64_t key = 0; key < 1500; key += 7) {
+      REQUIRE(tree.erase(key) == expected.erase(key));
+    }
+    check_same(tree, expected);
+  }
+  {
+    paged_tree tree(file.path(), cache_bytes);
+    check_same(tree, expected);
+    for (std::int64_t key = -1; key <= 1501; ++key) {
+      std::int64_t value = -1;
+      auto found = expected.find(key);
+      REQUIRE(tree.lookup(key, value) == (found != expected.end()));
+      if (found != expected.end()) {
+        REQUIRE(value == found->second);
+      }
+    }
+    std::size_t count = 0;
+    REQUIRE(tree.scan(100, 200, [&](std::int64_t, std::int64_t) {
+      ++count;
+    }) == count);
+    auto expected_count = std::distance(expected.lower_bound(100),
+                                        expected.lower_bound(200));
+    REQUIRE(count == static_cast<std::size_t>(expected_count));
+    tree.insert(-5, -5);
+    expected.emplace(-5, -5);
+  }
+  paged_tree tree(file.path(), cache_bytes);
+  check_same(tree, expected);
+}
+
+TEST_CASE("paged_btree rejects a file with other sizes", "[paged]") {
+  temp_file file("btree_test.sizes");
+  {
+    paged_tree tree(file.path(), cache_bytes);
+    tree.insert(1, 1);
+  }
+  using other_tree = amidvidy::paged_btree<std::int32_t, std::int64_t,
+                                           page_bytes>;
+  REQUIRE_THROWS_AS(other_tree(file.path(), cache_bytes), std::runtime_error);
+}
+
+TEST_CASE("btree::save writes a file mapped_btree and paged_btree open",
+          "[paged][mapped]") {
+  temp_file file("btree_test.saved");
+  amidvidy::btree<std::int64_t, std::int64_t> bt;
+  std::multimap<std::int64_t, std::int64_t> expected;
+  std::mt19937_64 rng(2);
+  for (std::int64_t i = 0; i < 5000; ++i) {
+    auto key = static_cast<std::int64_t>(rng() % 2000);
+    bt.insert(key, i);
+    expected.emplace(key, i);
+  }
+  bt.save<page_bytes>(file.path());
+
+  {
+    mapped_tree mapped(file.path());
+    check_same(mapped, expected);
+    for (std::int64_t key = -1; key <= 2001; ++key) {
+      auto lower = expected.lower_bound(key);
+      auto upper = expected.upper_bound(key);
+      auto mapped_lower = mapped.lower_bound(key);
+      auto mapped_upper = mapped.upper_bound(key);
+      REQUIRE((mapped_lower == mapped.end()) == (lower == expected.end()));
+      REQUIRE((mapped_upper == mapped.end()) == (upper == expected.end()));
+      if (lower != expected.end()) {
+        REQUIRE(std::get<1>(*mapped_lower) == lower->second);
+      }
+      if (upper != expected.end()) {
+        REQUIRE(std::get<1>(*mapped_upper) == upper->second);
+      }
+    }
+  }
+
+  // Changed through paged_btree, then mapped again.
+  {
+    paged_tree tree(file.path(), cache_bytes);
+    check_same(tree, expected);
+    for (std::int64_t i = 0; i < 1000; ++i) {
+      auto key = static_cast<std::int64_t>(rng() % 2000);
+      tree.insert(key, -i);
+      expected.emplace(key, -i);
+    }
+    REQUIRE(tree.erase(10) == expected.erase(10));
+  }
+  mapped_tree mapped(file.path());
+  check_same(mapped, expected);
+}
+
+TEST_CASE("mapped_btree rejects what is not a tree file", "[mapped]") {
+  temp_file file("btree_test.garbage");
+  {
+    std::FILE *f = std::fopen(file.path().c_str(), "wb");
+    REQUIRE(f);
+    std::string junk(3 * page_bytes, 'x');
+    std::fwrite(junk.data(), 1, junk.size(), f);
+    std::fclose(f);
+  }
+  REQUIRE_THROWS_AS(mapped_tree(file.path()), std::runtime_error);
+}
+
+TEST_CASE("mapped_btree throws on page numbers outside the file",
+          "[mapped]") {
+  using layout = amidvidy::detail::page_layout<std::int64_t, std::int64_t,
+                                               page_bytes>;
+  temp_file file("btree_test.corrupt");
+  amidvidy::btree<std::int64_t, std::int64_t> bt;
+  for (std::int64_t i = 0; i < 1000; ++i) {
+    bt.insert(i, i);
+  }
+  bt.save<page_bytes>(file.path());
+
+  // Writes `value` over the bytes at `offset` in the file.
+  auto patch = [&](std::size_t offset, amidvidy::detail::page_id value) {
+    amidvidy::detail::file f(file.path());
+    f.write_at(offset, &value, sizeof(value));
+  };
+
+  SECTION("root") {
+    patch(offsetof(layout::meta_page, root), 1 << 20);
+    mapped_tree mapped(file.path());
+    REQUIRE_THROWS_AS(mapped.find(5), std::runtime_error);
+    REQUIRE_THROWS_AS(mapped.begin(), std::runtime_error);
+  }
+
+  SECTION("next leaf") {
+    // Leaves are written first, from page 1 on.
+    patch(page_bytes + offsetof(layout::page_header, next), 1 << 20);
+    mapped_tree mapped(file.path());
+    auto walk = [&] {
+      for (auto iter = mapped.begin(); iter != mapped.end(); ++iter) {
+      }
+    };
+    auto ignore = [](std::int64_t, std::int64_t) {};
+    REQUIRE_THROWS_AS(walk(), std::runtime_error);
+    REQUIRE_THROWS_AS(mapped.scan(0, 1000, ignore), std::runtime_error);
+  }
+}